@@ -0,0 +1,280 @@
+#include "FrameBufferPool.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+
+// FrameBuffer
+
+FrameBuffer::FrameBuffer(const FrameBuffer& other) : m_block(other.m_block)
+{
+  if (m_block)
+    m_block->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+FrameBuffer::FrameBuffer(FrameBuffer&& other) noexcept : m_block(other.m_block)
+{
+  other.m_block = nullptr;
+}
+
+FrameBuffer& FrameBuffer::operator=(const FrameBuffer& other)
+{
+  if (this != &other)
+  {
+    FrameBuffer copy(other);
+    std::swap(m_block, copy.m_block);
+  }
+  return *this;
+}
+
+FrameBuffer& FrameBuffer::operator=(FrameBuffer&& other) noexcept
+{
+  if (this != &other)
+  {
+    reset();
+    m_block       = other.m_block;
+    other.m_block = nullptr;
+  }
+  return *this;
+}
+
+FrameBuffer::~FrameBuffer()
+{
+  reset();
+}
+
+uint8_t* FrameBuffer::data() const
+{
+  return m_block ? m_block->data : nullptr;
+}
+
+size_t FrameBuffer::capacity() const
+{
+  return m_block ? m_block->capacity : 0;
+}
+
+unsigned FrameBuffer::useCount() const
+{
+  return m_block ? m_block->refs.load(std::memory_order_relaxed) : 0;
+}
+
+void FrameBuffer::reset()
+{
+  if (m_block == nullptr)
+    return;
+
+  if (m_block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    m_block->pool->release(m_block);
+  m_block = nullptr;
+}
+
+// FrameBufferPool
+
+double FrameBufferPool::Stats::fragmentation() const
+{
+  if (bytesInUse == 0)
+    return 0.0;
+  return 1.0 - (double)bytesRequested / (double)bytesInUse;
+}
+
+FrameBufferPool& FrameBufferPool::instance()
+{
+  static FrameBufferPool pool;
+  return pool;
+}
+
+FrameBufferPool::FrameBufferPool(bool useHugePages) : m_useHugePages(useHugePages) {}
+
+FrameBufferPool::~FrameBufferPool()
+{
+  for (Arena& arena : m_arenas)
+    munmap(arena.base, arena.length);
+  for (FrameBuffer::Block* chunk : m_descriptorChunks)
+    delete[] chunk;
+}
+
+int FrameBufferPool::sizeClassFor(size_t size)
+{
+  for (int i = 0; i < FRAME_POOL_NUM_CLASSES; i++)
+  {
+    if (size <= ((size_t)1 << (FRAME_POOL_MIN_CLASS_SHIFT + i)))
+      return i;
+  }
+  return -1;
+}
+
+void* FrameBufferPool::mapArena(size_t length, bool& hugePages)
+{
+  void* base = MAP_FAILED;
+
+  hugePages = false;
+#ifdef MAP_HUGETLB
+  if (m_useHugePages && (length % FRAME_POOL_ARENA_SZ) == 0)
+  {
+    base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    hugePages = base != MAP_FAILED;
+  }
+#endif
+
+  if (base == MAP_FAILED)
+  {
+    /* no reserved huge pages, fall back to normal pages and let THP back them if it can */
+    base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+      return nullptr;
+#ifdef MADV_HUGEPAGE
+    if (m_useHugePages && length >= FRAME_POOL_ARENA_SZ)
+      madvise(base, length, MADV_HUGEPAGE);
+#endif
+  }
+
+  m_arenas.push_back({base, length, hugePages});
+  m_stats.bytesMapped += length;
+  m_stats.arenaAllocations++;
+  if (hugePages)
+    m_stats.hugePageArenas++;
+
+  return base;
+}
+
+bool FrameBufferPool::growClass(int sizeClass)
+{
+  size_t blockSize = (size_t)1 << (FRAME_POOL_MIN_CLASS_SHIFT + sizeClass);
+  size_t length    = std::max<size_t>(FRAME_POOL_ARENA_SZ, blockSize);
+  size_t count     = length / blockSize;
+  bool   hugePages;
+
+  auto* base = (uint8_t*)mapArena(length, hugePages);
+  if (base == nullptr)
+    return false;
+
+  auto* descriptors = new FrameBuffer::Block[count];
+  m_descriptorChunks.push_back(descriptors);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    FrameBuffer::Block* block = &descriptors[i];
+    block->refs.store(0, std::memory_order_relaxed);
+    block->pool      = this;
+    block->data      = base + i * blockSize;
+    block->capacity  = blockSize;
+    block->requested = 0;
+    block->sizeClass = sizeClass;
+    block->nextFree  = m_freeLists[sizeClass];
+    m_freeLists[sizeClass] = block;
+  }
+  m_stats.blocksFree += count;
+
+  return true;
+}
+
+FrameBuffer FrameBufferPool::acquire(size_t size)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  FrameBuffer::Block* block;
+  int                 sizeClass = sizeClassFor(size);
+
+  if (sizeClass < 0)
+  {
+    /* bigger than any slab, give it its own mapping */
+    bool  hugePages;
+    void* base = mapArena(ROUND_UP_ARENA(size), hugePages);
+    if (base == nullptr)
+      return FrameBuffer();
+
+    block            = new FrameBuffer::Block;
+    block->pool      = this;
+    block->data      = (uint8_t*)base;
+    block->capacity  = ROUND_UP_ARENA(size);
+    block->sizeClass = -1;
+    block->nextFree  = nullptr;
+  }
+  else
+  {
+    if (m_freeLists[sizeClass] == nullptr && !growClass(sizeClass))
+      return FrameBuffer();
+
+    block                  = m_freeLists[sizeClass];
+    m_freeLists[sizeClass] = block->nextFree;
+    block->nextFree        = nullptr;
+    m_stats.blocksFree--;
+  }
+
+  block->refs.store(1, std::memory_order_relaxed);
+  block->requested = size;
+
+  m_stats.blocksInUse++;
+  m_stats.bytesInUse += block->capacity;
+  m_stats.bytesRequested += size;
+  m_stats.highWaterMark = std::max(m_stats.highWaterMark, m_stats.bytesInUse);
+
+  return FrameBuffer(block);
+}
+
+void FrameBufferPool::reserve(size_t size, size_t count)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  int sizeClass = sizeClassFor(size);
+  if (sizeClass < 0)
+    return;
+
+  size_t available = 0;
+  for (FrameBuffer::Block* b = m_freeLists[sizeClass]; b != nullptr; b = b->nextFree)
+    available++;
+
+  size_t perArena = std::max<size_t>(FRAME_POOL_ARENA_SZ >> (FRAME_POOL_MIN_CLASS_SHIFT + sizeClass), 1);
+  while (available < count && growClass(sizeClass))
+    available += perArena;
+}
+
+void FrameBufferPool::release(FrameBuffer::Block* block)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  m_stats.blocksInUse--;
+  m_stats.bytesInUse -= block->capacity;
+  m_stats.bytesRequested -= block->requested;
+
+  if (block->sizeClass < 0)
+  {
+    auto it = std::find_if(m_arenas.begin(), m_arenas.end(), [&](const Arena& a) { return a.base == block->data; });
+    if (it != m_arenas.end())
+    {
+      munmap(it->base, it->length);
+      m_stats.bytesMapped -= it->length;
+      if (it->hugePages)
+        m_stats.hugePageArenas--;
+      m_arenas.erase(it);
+    }
+    delete block;
+    return;
+  }
+
+  block->nextFree                = m_freeLists[block->sizeClass];
+  m_freeLists[block->sizeClass] = block;
+  m_stats.blocksFree++;
+}
+
+FrameBufferPool::Stats FrameBufferPool::stats() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+void FrameBufferPool::printStats(FILE* out) const
+{
+  Stats s = stats();
+  fprintf(out,
+          "frame pool: mapped %zu KiB (%zu huge arenas, %llu maps), in use %zu KiB in %zu blocks, "
+          "%zu free blocks, high-water %zu KiB, fragmentation %.1f%%\n",
+          s.bytesMapped / 1024,
+          s.hugePageArenas,
+          (unsigned long long)s.arenaAllocations,
+          s.bytesInUse / 1024,
+          s.blocksInUse,
+          s.blocksFree,
+          s.highWaterMark / 1024,
+          s.fragmentation() * 100.0);
+}
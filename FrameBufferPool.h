@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+// Smallest and largest block handed out by the pool. Requests above the largest
+// class still succeed but get a dedicated mapping that is unmapped on release.
+#define FRAME_POOL_MIN_CLASS_SHIFT 12 // 4 KiB
+#define FRAME_POOL_MAX_CLASS_SHIFT 22 // 4 MiB
+#define FRAME_POOL_NUM_CLASSES (FRAME_POOL_MAX_CLASS_SHIFT - FRAME_POOL_MIN_CLASS_SHIFT + 1)
+
+// Arenas are carved out of mappings of this size (one 2 MiB huge page on x86-64).
+#define FRAME_POOL_ARENA_SZ (2u * 1024u * 1024u)
+#define ROUND_UP_ARENA(num) (((num) + FRAME_POOL_ARENA_SZ - 1) & ~((size_t)FRAME_POOL_ARENA_SZ - 1))
+
+class FrameBufferPool;
+
+/*
+ * FrameBuffer:
+ *
+ * Refcounted handle to a block owned by a FrameBufferPool. Copying a handle
+ * shares the block, the block goes back to its slab's free list when the last
+ * handle is dropped. Handles may be passed between threads, the refcount is
+ * atomic.
+ */
+class FrameBuffer
+{
+public:
+  FrameBuffer() = default;
+  FrameBuffer(const FrameBuffer& other);
+  FrameBuffer(FrameBuffer&& other) noexcept;
+  FrameBuffer& operator=(const FrameBuffer& other);
+  FrameBuffer& operator=(FrameBuffer&& other) noexcept;
+  ~FrameBuffer();
+
+  uint8_t* data() const;
+  size_t   capacity() const;
+  explicit operator bool() const
+  {
+    return m_block != nullptr;
+  }
+
+  unsigned useCount() const;
+  void     reset();
+
+private:
+  friend class FrameBufferPool;
+
+  struct Block
+  {
+    std::atomic<unsigned> refs;
+    FrameBufferPool*      pool;
+    uint8_t*              data;
+    size_t                capacity;  // usable bytes (size class or dedicated mapping)
+    size_t                requested; // bytes the caller asked for, for fragmentation stats
+    int                   sizeClass; // -1 for a dedicated oversized mapping
+    Block*                nextFree;
+  };
+
+  explicit FrameBuffer(Block* block) : m_block(block) {}
+
+  Block* m_block = nullptr;
+};
+
+class FrameBufferPool
+{
+public:
+  struct Stats
+  {
+    size_t   bytesMapped;        // total bytes of arenas + dedicated mappings
+    size_t   bytesInUse;         // block capacity currently held by handles
+    size_t   bytesRequested;     // bytes callers asked for, out of bytesInUse
+    size_t   highWaterMark;      // peak of bytesInUse
+    size_t   hugePageArenas;     // arenas backed by MAP_HUGETLB
+    size_t   blocksInUse;
+    size_t   blocksFree;
+    uint64_t arenaAllocations;   // number of mmap calls, stays flat in steady state
+    double   fragmentation() const; // 1 - requested / in use (internal fragmentation)
+  };
+
+  // Process-wide pool used by every source and sink.
+  static FrameBufferPool& instance();
+
+  explicit FrameBufferPool(bool useHugePages = true);
+  ~FrameBufferPool();
+
+  FrameBufferPool(const FrameBufferPool&)            = delete;
+  FrameBufferPool& operator=(const FrameBufferPool&) = delete;
+
+  // Returns an empty handle only if the kernel refuses to map more memory.
+  FrameBuffer acquire(size_t size);
+
+  // Maps enough arenas up front that `count` blocks of `size` can be acquired
+  // without touching the kernel, e.g. before accepting clients.
+  void reserve(size_t size, size_t count);
+
+  Stats stats() const;
+  void  printStats(FILE* out) const;
+
+private:
+  friend class FrameBuffer;
+
+  struct Arena
+  {
+    void*  base;
+    size_t length;
+    bool   hugePages;
+  };
+
+  static int sizeClassFor(size_t size);
+  void*      mapArena(size_t length, bool& hugePages);
+  bool       growClass(int sizeClass);
+  void       release(FrameBuffer::Block* block);
+
+  bool m_useHugePages;
+
+  mutable std::mutex  m_mutex;
+  FrameBuffer::Block* m_freeLists[FRAME_POOL_NUM_CLASSES] = {};
+  std::vector<Arena>  m_arenas;
+  // Block descriptors live outside the arenas so that huge pages only hold frame bytes.
+  std::vector<FrameBuffer::Block*> m_descriptorChunks;
+
+  Stats m_stats = {};
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/*
+ * FrameQueue:
+ *
+ * Bounded lock-free multi-producer, single-consumer queue (Vyukov's bounded
+ * ring). Any number of threads may push(), one thread pops. Elements are moved
+ * in and out, so a FrameBuffer handle changes owner without copying the frame.
+ *
+ * Every cell carries a sequence number telling producers and the consumer
+ * whose turn it is, so neither side ever waits on the other: push() fails
+ * when the ring is full and pop() when it is empty.
+ */
+template <typename T, size_t Capacity>
+class FrameQueue
+{
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+  FrameQueue()
+  {
+    for (size_t i = 0; i < Capacity; i++)
+      m_cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  FrameQueue(const FrameQueue&)            = delete;
+  FrameQueue& operator=(const FrameQueue&) = delete;
+
+  // Any thread. Leaves value untouched and returns false if the queue is full.
+  bool push(T&& value)
+  {
+    Cell*  cell;
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    for (;;)
+    {
+      cell          = &m_cells[pos & (Capacity - 1)];
+      size_t   seq  = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0)
+      {
+        if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if (diff < 0)
+        return false;
+      else
+        pos = m_tail.load(std::memory_order_relaxed);
+    }
+
+    cell->value = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer thread only. Returns false if the queue is empty.
+  bool pop(T& value)
+  {
+    Cell*  cell = &m_cells[m_head & (Capacity - 1)];
+    size_t seq  = cell->sequence.load(std::memory_order_acquire);
+    if ((intptr_t)seq - (intptr_t)(m_head + 1) < 0)
+      return false;
+
+    value = std::move(cell->value);
+    cell->sequence.store(m_head + Capacity, std::memory_order_release);
+    m_head++;
+    return true;
+  }
+
+private:
+  struct alignas(64) Cell
+  {
+    std::atomic<size_t> sequence;
+    T                   value;
+  };
+
+  Cell m_cells[Capacity];
+
+  // producers and the consumer each get their own cache line
+  alignas(64) std::atomic<size_t> m_tail{0};
+  alignas(64) size_t m_head = 0;
+};
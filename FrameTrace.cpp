@@ -0,0 +1,210 @@
+#include "FrameTrace.h"
+
+#ifdef JPEG_TRACE
+
+  #include <UsageEnvironment.hh>
+
+  #include <fcntl.h>
+  #include <signal.h>
+  #include <sys/syscall.h>
+  #include <time.h>
+  #include <unistd.h>
+
+  #include <cstdio>
+  #include <mutex>
+  #include <vector>
+
+namespace
+{
+
+  // One event, written by the owning thread while dump() may be reading it from another. seq is 2 * i + 1 while
+  // the ring's i-th event is being stored here and 2 * i + 2 once it is complete; a reader that finds another
+  // stamp, or sees it change during its copy, drops the copy.
+  struct Slot
+  {
+    std::atomic<uint64_t>    seq{0};
+    std::atomic<const char*> name{nullptr};
+    std::atomic<uint64_t>    startNs{0};
+    std::atomic<uint64_t>    durationNs{0};
+    std::atomic<uint32_t>    id{0};
+  };
+
+  // Single writer (the owning thread); dump() reads concurrently and skips the slots being rewritten.
+  struct Ring
+  {
+    Slot                  events[TRACE_RING_SZ];
+    std::atomic<uint64_t> head{0};
+    long                  tid;
+  };
+
+  std::mutex         s_ringsMutex;
+  std::vector<Ring*> s_rings;
+
+  int s_signalPipe[2] = {-1, -1};
+
+  std::atomic<uint32_t> s_frameIds{0};
+
+  Ring* threadRing()
+  {
+    thread_local Ring* ring = nullptr;
+    if (ring == nullptr)
+    {
+      /* rings outlive their thread so that a later dump still sees its events */
+      ring      = new Ring;
+      ring->tid = syscall(SYS_gettid);
+
+      std::lock_guard<std::mutex> lock(s_ringsMutex);
+      s_rings.push_back(ring);
+    }
+    return ring;
+  }
+
+  void onSignal(int)
+  {
+    char c = 0;
+    (void)!write(s_signalPipe[1], &c, 1);
+  }
+
+  void onSignalPipe(void* /*clientData*/, int /*mask*/)
+  {
+    char buf[16];
+    while (read(s_signalPipe[0], buf, sizeof buf) > 0)
+      ;
+
+    char path[64];
+    snprintf(path, sizeof path, TRACE_OUTPUT, (long)getpid());
+    if (FrameTrace::dump(path))
+      fprintf(stderr, "trace written to %s\n", path);
+  }
+
+} // namespace
+
+uint64_t FrameTrace::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t FrameTrace::nextFrameId()
+{
+  /* pushing threads take ids too */
+  return s_frameIds.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+void FrameTrace::record(const char* name, uint64_t startNs, uint64_t durationNs, uint32_t id)
+{
+  Ring*    ring = threadRing();
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+  Slot&    slot = ring->events[head & (TRACE_RING_SZ - 1)];
+
+  /* seqlock: mark the slot busy before touching the fields, complete once they are all stored */
+  slot.seq.store(2 * head + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.name.store(name, std::memory_order_relaxed);
+  slot.startNs.store(startNs, std::memory_order_relaxed);
+  slot.durationNs.store(durationNs, std::memory_order_relaxed);
+  slot.id.store(id, std::memory_order_relaxed);
+  slot.seq.store(2 * head + 2, std::memory_order_release);
+
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool FrameTrace::dump(const char* path)
+{
+  FILE* fp = fopen(path, "w");
+  if (fp == nullptr)
+    return false;
+
+  long pid   = getpid();
+  bool first = true;
+
+  fprintf(fp, "{\"traceEvents\":[\n");
+
+  std::lock_guard<std::mutex> lock(s_ringsMutex);
+  for (Ring* ring : s_rings)
+  {
+    uint64_t head  = ring->head.load(std::memory_order_acquire);
+    uint64_t start = head > TRACE_RING_SZ ? head - TRACE_RING_SZ : 0;
+
+    for (uint64_t i = start; i < head; i++)
+    {
+      const Slot& slot = ring->events[i & (TRACE_RING_SZ - 1)];
+
+      /* the owning thread keeps recording while we read: drop events it overwrote or is rewriting */
+      uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      if (seq != 2 * i + 2)
+        continue;
+      FrameTrace::Event e = {slot.name.load(std::memory_order_relaxed),
+                             slot.startNs.load(std::memory_order_relaxed),
+                             slot.durationNs.load(std::memory_order_relaxed),
+                             slot.id.load(std::memory_order_relaxed)};
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != seq)
+        continue;
+
+      fprintf(fp, "%s", first ? "" : ",\n");
+      first = false;
+
+      if (e.durationNs == 0)
+        fprintf(fp,
+                "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%ld,\"tid\":%ld,\"args\":{\"frame\":%u}}",
+                e.name,
+                e.startNs / 1000.0,
+                pid,
+                ring->tid,
+                e.id);
+      else
+        fprintf(fp,
+                "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%ld,\"args\":{\"frame\":%u}}",
+                e.name,
+                e.startNs / 1000.0,
+                e.durationNs / 1000.0,
+                pid,
+                ring->tid,
+                e.id);
+    }
+  }
+
+  fprintf(fp, "\n]}\n");
+  return fclose(fp) == 0;
+}
+
+void FrameTrace::installSignalHandler(UsageEnvironment& env)
+{
+  if (s_signalPipe[0] >= 0)
+    return;
+
+  /* the handler only pokes a pipe, the dump itself runs from the event loop */
+  if (pipe(s_signalPipe) != 0)
+    return;
+  fcntl(s_signalPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(s_signalPipe[1], F_SETFL, O_NONBLOCK);
+
+  env.taskScheduler().turnOnBackgroundReadHandling(s_signalPipe[0], onSignalPipe, nullptr);
+
+  struct sigaction sa = {};
+  sa.sa_handler       = onSignal;
+  sa.sa_flags         = SA_RESTART;
+  sigaction(SIGUSR1, &sa, nullptr);
+}
+
+void FrameTrace::afterFork()
+{
+  if (s_signalPipe[0] >= 0)
+  {
+    close(s_signalPipe[0]);
+    close(s_signalPipe[1]);
+    s_signalPipe[0] = s_signalPipe[1] = -1;
+  }
+
+  /* only the forking thread lives on in the child, under a new tid; no lock,
+   * a thread that held s_ringsMutex at the fork is gone */
+  for (Ring* ring : s_rings)
+    ring->head.store(0, std::memory_order_relaxed);
+  Ring* ring = threadRing();
+  ring->tid  = syscall(SYS_gettid);
+}
+
+#endif // JPEG_TRACE
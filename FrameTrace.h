@@ -0,0 +1,105 @@
+#ifndef JPEGSTREAMER_FRAMETRACE_H
+#define JPEGSTREAMER_FRAMETRACE_H
+
+/*
+ * Per-frame lifecycle tracing.
+ *
+ * Build with -DJPEG_TRACE=ON to record where each frame spends its time, from
+ * reading the input to the RTP packets and RTCP receiver reports. Events go to
+ * a lock-free ring per thread and are written out as Chrome trace-event JSON
+ * (chrome://tracing, Perfetto) by FrameTrace::dump() or on SIGUSR1.
+ *
+ * Every event carries the id of its frame. The id is taken with
+ * TRACE_NEXT_FRAME_ID() where a frame enters the process (file read, push,
+ * upstream packet, live input) and travels with it as JPEGFrame::traceId,
+ * through crops and the shared ring included, to the packets it goes out in.
+ * RTCP receiver reports belong to no frame and carry the client session id.
+ *
+ * Without JPEG_TRACE every macro below expands to nothing.
+ */
+
+#ifdef JPEG_TRACE
+
+  #include <atomic>
+  #include <cstdint>
+
+// Events kept per thread; older ones are overwritten.
+  #define TRACE_RING_SZ (1u << 16)
+
+// Written on SIGUSR1, in the working directory; %ld is the process id, so that workers do not overwrite each other.
+  #define TRACE_OUTPUT "jpeg_trace.%ld.json"
+
+class UsageEnvironment;
+
+namespace FrameTrace
+{
+
+  struct Event
+  {
+    const char* name;
+    uint64_t    startNs;
+    uint64_t    durationNs; // 0 for an instant event
+    uint32_t    id;         // frame the event belongs to
+  };
+
+  uint64_t now();
+
+  // A new frame id, unique within the process.
+  uint32_t nextFrameId();
+
+  void record(const char* name, uint64_t startNs, uint64_t durationNs, uint32_t id);
+
+  // Writes every thread's ring as {"traceEvents": [...]}, returns false if path cannot be written.
+  bool dump(const char* path);
+
+  // Dumps to TRACE_OUTPUT from the event loop whenever the process receives SIGUSR1.
+  void installSignalHandler(UsageEnvironment& env);
+
+  // In a forked child: drops the parent's events and signal pipe, so that
+  // installSignalHandler() sets the child up on its own.
+  void afterFork();
+
+  class Scope
+  {
+  public:
+    Scope(const char* name, uint32_t id) : m_name(name), m_id(id), m_start(now()) {}
+    ~Scope()
+    {
+      record(m_name, m_start, now() - m_start, m_id);
+    }
+
+  private:
+    const char* m_name;
+    uint32_t    m_id;
+    uint64_t    m_start;
+  };
+
+} // namespace FrameTrace
+
+  #define TRACE_CONCAT_(a, b) a##b
+  #define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+  #define TRACE_SCOPE(name, id) FrameTrace::Scope TRACE_CONCAT(trace_scope_, __LINE__)((name), (uint32_t)(id))
+  #define TRACE_INSTANT(name, id) FrameTrace::record((name), FrameTrace::now(), 0, (uint32_t)(id))
+  #define TRACE_INSTALL_SIGNAL(env) FrameTrace::installSignalHandler(env)
+  #define TRACE_AFTER_FORK() FrameTrace::afterFork()
+  #define TRACE_NEXT_FRAME_ID() FrameTrace::nextFrameId()
+
+  // For spans that do not fit a scope: take TRACE_NOW() where it starts, TRACE_SINCE() where it ends.
+  #define TRACE_NOW() FrameTrace::now()
+  #define TRACE_SINCE(name, startNs, id) \
+    FrameTrace::record((name), (startNs), FrameTrace::now() - (startNs), (uint32_t)(id))
+
+#else
+
+  #define TRACE_SCOPE(name, id)
+  #define TRACE_INSTANT(name, id)
+  #define TRACE_INSTALL_SIGNAL(env)
+  #define TRACE_AFTER_FORK()
+  #define TRACE_NEXT_FRAME_ID() 0
+  #define TRACE_NOW() 0
+  #define TRACE_SINCE(name, startNs, id)
+
+#endif // JPEG_TRACE
+
+#endif // JPEGSTREAMER_FRAMETRACE_H
@@ -0,0 +1,482 @@
+#include "JPEGCrop.h"
+#include "JPEGHeaders.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+
+  using JpegHeaders::BitWriter;
+  using JpegHeaders::HuffTable;
+
+  // Bits decoded with one table lookup; longer codes are searched length by length.
+  constexpr unsigned k_lookupBits = 9;
+
+  // Coefficient index advance of an AC lookup that ends the block.
+  constexpr uint8_t k_endOfBlock = 64;
+
+  struct HuffDecoder
+  {
+    uint8_t        lookupSize[1 << k_lookupBits]; // 0 if the code is longer
+    uint8_t        lookupValue[1 << k_lookupBits];
+    int32_t        maxCode[17];                   // largest code of each length, -1 for none
+    int32_t        valOffset[17];
+    const uint8_t* vals;
+
+    // AC only: an AC code and its extra bits skipped at once when both fit the lookup bits
+    uint8_t skipSize[1 << k_lookupBits]; // 0 if they do not
+    uint8_t skipAdvance[1 << k_lookupBits];
+
+    HuffDecoder(const uint8_t bits[16], const uint8_t* values) : vals(values)
+    {
+      memset(lookupSize, 0, sizeof lookupSize);
+      memset(skipSize, 0, sizeof skipSize);
+
+      int32_t  code = 0;
+      unsigned k    = 0;
+      for (unsigned len = 1; len <= 16; len++)
+      {
+        valOffset[len] = (int32_t)k - code;
+        for (unsigned i = 0; i < bits[len - 1]; i++, k++, code++)
+        {
+          if (len > k_lookupBits)
+            continue;
+          unsigned first = code << (k_lookupBits - len);
+          unsigned run = vals[k] >> 4, size = vals[k] & 15;
+          for (unsigned j = 0; j < (1u << (k_lookupBits - len)); j++)
+          {
+            lookupSize[first + j]  = len;
+            lookupValue[first + j] = vals[k];
+            if (len + size <= k_lookupBits)
+            {
+              skipSize[first + j]    = len + size;
+              skipAdvance[first + j] = size != 0 ? run + 1 : (run == 15 ? 16 : k_endOfBlock);
+            }
+          }
+        }
+        maxCode[len] = bits[len - 1] ? code - 1 : -1;
+        code <<= 1;
+      }
+    }
+  };
+
+  const HuffDecoder k_dcLuma(JpegHeaders::dc_luma_bits, JpegHeaders::dc_vals);
+  const HuffDecoder k_dcChroma(JpegHeaders::dc_chroma_bits, JpegHeaders::dc_vals);
+  const HuffDecoder k_acLuma(JpegHeaders::ac_luma_bits, JpegHeaders::ac_luma_vals);
+  const HuffDecoder k_acChroma(JpegHeaders::ac_chroma_bits, JpegHeaders::ac_chroma_vals);
+
+  const HuffTable k_dcLumaCodes(JpegHeaders::dc_luma_bits, JpegHeaders::dc_vals);
+  const HuffTable k_dcChromaCodes(JpegHeaders::dc_chroma_bits, JpegHeaders::dc_vals);
+
+  // Padding after a restart interval's bytes, so that reads just past its end stay in the buffer.
+  constexpr size_t k_readSlack = 8;
+
+  /*
+   * Reads the bits of one restart interval, byte stuffing already undone.
+   * Running past the end is only noticed by overrun(), checked once per MCU.
+   */
+  class BitReader
+  {
+  public:
+    void reset(const std::vector<uint8_t>& data)
+    {
+      m_data = data.data();
+      m_bits = (data.size() - k_readSlack) * 8;
+      m_pos  = 0;
+    }
+
+    size_t position() const
+    {
+      return m_pos;
+    }
+
+    bool overrun() const
+    {
+      return m_pos > m_bits;
+    }
+
+    // 16 bits starting at pos
+    uint32_t peekAt(size_t pos) const
+    {
+      uint64_t word;
+      memcpy(&word, m_data + std::min(pos, m_bits) / 8, sizeof word);
+      return (uint32_t)((__builtin_bswap64(word) << (pos & 7)) >> 48);
+    }
+
+    // Skips an AC code and its extra bits, returns the coefficient index advance or 0 for the slow path.
+    unsigned skip(const HuffDecoder& table)
+    {
+      unsigned index = peekAt(m_pos) >> (16 - k_lookupBits);
+      m_pos += table.skipSize[index];
+      return table.skipSize[index] != 0 ? table.skipAdvance[index] : 0;
+    }
+
+    unsigned get(unsigned count)
+    {
+      unsigned bits = count ? peekAt(m_pos) >> (16 - count) : 0;
+      m_pos += count;
+      return bits;
+    }
+
+    // -1 for a code the table does not have
+    int decode(const HuffDecoder& table)
+    {
+      uint32_t bits = peekAt(m_pos);
+      unsigned index = bits >> (16 - k_lookupBits);
+      if (table.lookupSize[index] != 0)
+      {
+        m_pos += table.lookupSize[index];
+        return table.lookupValue[index];
+      }
+      for (unsigned len = k_lookupBits + 1; len <= 16; len++)
+      {
+        int32_t code = bits >> (16 - len);
+        if (code <= table.maxCode[len])
+        {
+          m_pos += len;
+          return table.vals[table.valOffset[len] + code];
+        }
+      }
+      m_pos = m_bits + 1;
+      return -1;
+    }
+
+  private:
+    const uint8_t* m_data = nullptr;
+    size_t         m_bits = 0;
+    size_t         m_pos  = 0;
+  };
+
+  int extend(unsigned bits, unsigned category)
+  {
+    return bits < (1u << (category - 1)) ? (int)bits - (1 << category) + 1 : (int)bits;
+  }
+
+  class Cropper
+  {
+  public:
+    Cropper(const uint8_t* scan, uint32_t scanSize, unsigned lumaBlocks, unsigned restartInterval, std::vector<uint8_t>& out)
+        : m_scan(scan), m_scanSize(scanSize), m_lumaBlocks(lumaBlocks), m_restartInterval(restartInterval), m_writer(out)
+    {}
+
+    bool indexIntervals();
+    bool copyMCU(unsigned mcu);
+    void finish();
+
+  private:
+    bool seek(unsigned mcu);
+    void loadInterval(unsigned interval);
+    bool block(int& predictor, int& outPredictor, const HuffDecoder& dc, const HuffDecoder& ac, const HuffTable* dcCodes);
+    void copy(size_t from, size_t to);
+    void flushCopy();
+
+  private:
+    const uint8_t* m_scan;
+    uint32_t       m_scanSize;
+    unsigned       m_lumaBlocks;
+    unsigned       m_restartInterval; // MCUs, 0 without DRI
+
+    // [begin, end) of every restart interval's entropy-coded bytes in the scan
+    std::vector<std::pair<uint32_t, uint32_t>> m_intervals;
+
+    std::vector<uint8_t> m_data; // current interval, unstuffed
+    BitReader            m_reader;
+    unsigned             m_interval = ~0u;
+    unsigned             m_mcu      = 0; // next MCU m_reader is at
+    int                  m_predictor[3];
+
+    BitWriter m_writer;
+    int       m_outPredictor[3] = {0, 0, 0};
+    size_t    m_copyFrom        = 0; // pending copy of [m_copyFrom, m_copyTo) of m_data
+    size_t    m_copyTo          = 0;
+  };
+
+  bool Cropper::indexIntervals()
+  {
+    uint32_t begin = 0;
+    uint32_t pos   = 0;
+    while (pos + 1 < m_scanSize)
+    {
+      auto* ff = (const uint8_t*)memchr(m_scan + pos, JpegParser::JPEG_MARKER, m_scanSize - pos - 1);
+      if (ff == nullptr)
+        break;
+      pos = ff - m_scan;
+
+      uint8_t next = m_scan[pos + 1];
+      if (next == 0x00 || next == JpegParser::JPEG_MARKER)
+      {
+        /* stuffed byte, or fill byte before a marker */
+        pos += next == 0x00 ? 2 : 1;
+        continue;
+      }
+      if (next >= 0xD0 && next <= 0xD7)
+      {
+        m_intervals.push_back({begin, pos});
+        pos += 2;
+        begin = pos;
+        continue;
+      }
+      /* EOI or anything else ends the scan */
+      m_scanSize = pos;
+      break;
+    }
+    m_intervals.push_back({begin, m_scanSize});
+    return !m_intervals.empty();
+  }
+
+  void Cropper::loadInterval(unsigned interval)
+  {
+    flushCopy();
+
+    auto [begin, end] = m_intervals[interval];
+    m_data.clear();
+    m_data.reserve(end - begin + k_readSlack);
+    while (begin < end)
+    {
+      auto*    ff   = (const uint8_t*)memchr(m_scan + begin, JpegParser::JPEG_MARKER, end - begin);
+      uint32_t stop = ff != nullptr ? ff - m_scan + 1 : end;
+      m_data.insert(m_data.end(), m_scan + begin, m_scan + stop);
+      begin = stop;
+      /* drop the zero stuffed after 0xFF */
+      if (ff != nullptr && begin < end && m_scan[begin] == 0x00)
+        begin++;
+    }
+    m_data.insert(m_data.end(), k_readSlack, 0);
+
+    m_reader.reset(m_data);
+    m_interval = interval;
+    m_mcu      = m_restartInterval != 0 ? interval * m_restartInterval : 0;
+    std::fill(m_predictor, m_predictor + 3, 0);
+  }
+
+  bool Cropper::seek(unsigned mcu)
+  {
+    unsigned interval = m_restartInterval != 0 ? mcu / m_restartInterval : 0;
+    if (interval >= m_intervals.size())
+      return false;
+
+    /* intervals before the one holding mcu are never decoded */
+    if (interval != m_interval)
+      loadInterval(interval);
+
+    int ignored[3];
+    while (m_mcu < mcu)
+    {
+      for (unsigned b = 0; b < m_lumaBlocks; b++)
+        if (!block(m_predictor[0], ignored[0], k_dcLuma, k_acLuma, nullptr))
+          return false;
+      if (!block(m_predictor[1], ignored[1], k_dcChroma, k_acChroma, nullptr) ||
+          !block(m_predictor[2], ignored[2], k_dcChroma, k_acChroma, nullptr))
+        return false;
+      m_mcu++;
+    }
+    return true;
+  }
+
+  bool Cropper::copyMCU(unsigned mcu)
+  {
+    if (!seek(mcu))
+      return false;
+
+    for (unsigned b = 0; b < m_lumaBlocks; b++)
+      if (!block(m_predictor[0], m_outPredictor[0], k_dcLuma, k_acLuma, &k_dcLumaCodes))
+        return false;
+    if (!block(m_predictor[1], m_outPredictor[1], k_dcChroma, k_acChroma, &k_dcChromaCodes) ||
+        !block(m_predictor[2], m_outPredictor[2], k_dcChroma, k_acChroma, &k_dcChromaCodes))
+      return false;
+    m_mcu++;
+
+    return !m_reader.overrun();
+  }
+
+  // Decodes one block, and with dcCodes copies it to the output, recoding its DC if the output's predictor differs.
+  bool Cropper::block(int& predictor, int& outPredictor, const HuffDecoder& dc, const HuffDecoder& ac, const HuffTable* dcCodes)
+  {
+    size_t start    = m_reader.position();
+    int    category = m_reader.decode(dc);
+    if (category < 0 || category > 11)
+      return false;
+    int value = predictor + (category ? extend(m_reader.get(category), category) : 0);
+
+    size_t acStart = m_reader.position();
+    for (unsigned k = 1; k < 64;)
+    {
+      if (unsigned advance = m_reader.skip(ac))
+      {
+        k += advance;
+        continue;
+      }
+
+      int symbol = m_reader.decode(ac);
+      if (symbol < 0)
+        return false;
+      unsigned run = symbol >> 4, size = symbol & 15;
+      if (size == 0)
+      {
+        if (run != 15)
+          break; /* EOB */
+        k += 16;
+        continue;
+      }
+      m_reader.get(size);
+      k += run + 1;
+    }
+
+    if (dcCodes != nullptr)
+    {
+      if (outPredictor == predictor)
+        copy(start, m_reader.position());
+      else
+      {
+        flushCopy();
+        int      diff = value - outPredictor;
+        unsigned cat  = JpegHeaders::magnitude_bits(diff);
+        m_writer.put(dcCodes->code[cat], dcCodes->size[cat]);
+        if (cat)
+          m_writer.put(diff < 0 ? diff - 1 : diff, cat);
+        copy(acStart, m_reader.position());
+      }
+      outPredictor = value;
+    }
+
+    predictor = value;
+    return !m_reader.overrun();
+  }
+
+  void Cropper::copy(size_t from, size_t to)
+  {
+    if (from != m_copyTo)
+    {
+      flushCopy();
+      m_copyFrom = from;
+    }
+    m_copyTo = to;
+  }
+
+  void Cropper::flushCopy()
+  {
+    size_t pos = m_copyFrom;
+    for (; pos + 16 <= m_copyTo; pos += 16)
+      m_writer.put(m_reader.peekAt(pos), 16);
+    if (pos < m_copyTo)
+      m_writer.put(m_reader.peekAt(pos) >> (16 - (m_copyTo - pos)), m_copyTo - pos);
+    m_copyFrom = m_copyTo = 0;
+  }
+
+  void Cropper::finish()
+  {
+    flushCopy();
+    m_writer.flush();
+  }
+
+} // namespace
+
+namespace JpegCrop
+{
+
+  bool parse_region(const char* spec, Region& region)
+  {
+    char trailing;
+    if (sscanf(spec, "%u,%u,%u,%u%c", &region.x, &region.y, &region.width, &region.height, &trailing) != 4)
+      return false;
+    return region.width > 0 && region.height > 0;
+  }
+
+  std::string region_name(const Region& region)
+  {
+    char name[64];
+    snprintf(name, sizeof name, "%u,%u,%u,%u", region.x, region.y, region.width, region.height);
+    return name;
+  }
+
+  bool image_size(const uint8_t* header, uint32_t header_size, unsigned& width, unsigned& height)
+  {
+    uint32_t offset = 0;
+    while (offset < header_size)
+    {
+      uint8_t marker = JpegParser::scan_marker(header, header_size, offset);
+      switch (marker)
+      {
+      case JpegParser::JPEG_MARKER_SOF:
+        /* length, precision, then height and width */
+        if (offset + 7 > header_size)
+          return false;
+        offset += 3;
+        height = JpegParser::read_uint16_t(header, header_size, offset);
+        width  = JpegParser::read_uint16_t(header, header_size, offset);
+        return width > 0 && height > 0;
+      case JpegParser::JPEG_MARKER_SOS:
+      case JpegParser::JPEG_MARKER_EOI:
+        return false;
+      case JpegParser::JPEG_MARKER_SOI:
+        break;
+      default:
+        JpegParser::skip_marker(header, header_size, offset);
+        break;
+      }
+    }
+    return false;
+  }
+
+  bool crop(const uint8_t*                    buffer,
+            const JpegParser::RtpJPEGPayload& payload,
+            const std::vector<uint8_t>&       quantisation,
+            unsigned                          precision,
+            const Region&                     region,
+            std::vector<uint8_t>&             out)
+  {
+    uint8_t type = payload.type & 63;
+    if (payload.payload == nullptr || type > 1 || quantisation.empty())
+      return false;
+
+    unsigned width, height;
+    if (!image_size(buffer, payload.payload - buffer, width, height))
+      return false;
+
+    /* type 0 is 4:2:2 with 16x8 MCUs of two luma blocks, type 1 4:2:0 with 16x16 MCUs of four */
+    unsigned mcuWidth   = 16;
+    unsigned mcuHeight  = type == 0 ? 8 : 16;
+    unsigned mcusPerRow = (width + mcuWidth - 1) / mcuWidth;
+    unsigned mcuRows    = (height + mcuHeight - 1) / mcuHeight;
+
+    if (region.x >= width || region.y >= height)
+      return false;
+    unsigned x0 = region.x / mcuWidth;
+    unsigned y0 = region.y / mcuHeight;
+    unsigned x1 = std::min(mcusPerRow, (std::min(region.x + region.width, width) + mcuWidth - 1) / mcuWidth);
+    unsigned y1 = std::min(mcuRows, (std::min(region.y + region.height, height) + mcuHeight - 1) / mcuHeight);
+
+    unsigned outWidth  = std::min(x1 * mcuWidth, width) - x0 * mcuWidth;
+    unsigned outHeight = std::min(y1 * mcuHeight, height) - y0 * mcuHeight;
+    if (outWidth > 2040 || outHeight > 2040)
+      return false;
+
+    JpegHeaders::make_headers(
+        out, type, ROUND_UP_8(outWidth) / 8, ROUND_UP_8(outHeight) / 8, quantisation.data(), precision, 0);
+
+    Cropper cropper(payload.payload,
+                    payload.size,
+                    type == 0 ? 2 : 4,
+                    payload.type >= 64 ? payload.restart_interval : 0,
+                    out);
+    if (!cropper.indexIntervals())
+      return false;
+
+    for (unsigned row = y0; row < y1; row++)
+    {
+      for (unsigned column = x0; column < x1; column++)
+      {
+        if (!cropper.copyMCU(row * mcusPerRow + column))
+          return false;
+      }
+    }
+    cropper.finish();
+
+    out.push_back(JpegParser::JPEG_MARKER);
+    out.push_back(JpegParser::JPEG_MARKER_EOI);
+    return true;
+  }
+
+} // namespace JpegCrop
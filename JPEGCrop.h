@@ -0,0 +1,66 @@
+#ifndef JPEGSTREAMER_JPEGCROP_H
+#define JPEGSTREAMER_JPEGCROP_H
+
+#include "JPEGParser.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace JpegCrop
+{
+
+  /*
+   * Region:
+   * A rectangle of the source image in pixels. It is widened to whole MCUs
+   * (16x8 for type 0, 16x16 for type 1) when cropped.
+   */
+  struct Region
+  {
+    unsigned x      = 0;
+    unsigned y      = 0;
+    unsigned width  = 0;
+    unsigned height = 0;
+  };
+
+  /*
+   * parse_region:
+   * Reads "x,y,w,h" as given in a stream's ?roi= query. Returns false for
+   * anything else or an empty rectangle.
+   */
+  bool parse_region(const char* spec, Region& region);
+
+  /* the canonical "x,y,w,h" form of region, so that equal regions name the same stream */
+  std::string region_name(const Region& region);
+
+  /*
+   * image_size:
+   * Width and height in pixels from the SOF of the header_size bytes of
+   * header, unclamped unlike the 8 pixel units of RtpJPEGPayload.
+   */
+  bool image_size(const uint8_t* header, uint32_t header_size, unsigned& width, unsigned& height);
+
+  /*
+   * crop:
+   * Appends to out a JPEG of the MCUs of frame covering region, cut from the
+   * entropy-coded scan without decoding it to pixels. MCUs are copied as
+   * they are coded; only the DC differential of a block whose predecessor
+   * changed (the first blocks of every row, and those after a restart marker
+   * in the source) is coded afresh. With DRI in the source, restart intervals
+   * holding none of the region are skipped without Huffman decoding them.
+   *
+   * Like every RTP/JPEG type 0/1 scan, the source is taken to be coded with
+   * the standard Huffman tables. The result has no restart markers. Returns
+   * false if the frame cannot be cropped or region lies outside it or would
+   * not fit the 2040 pixel limit of RTP/JPEG.
+   */
+  bool crop(const uint8_t*                    buffer,
+            const JpegParser::RtpJPEGPayload& payload,
+            const std::vector<uint8_t>&       quantisation,
+            unsigned                          precision,
+            const Region&                     region,
+            std::vector<uint8_t>&             out);
+
+} // namespace JpegCrop
+
+#endif // JPEGSTREAMER_JPEGCROP_H
@@ -0,0 +1,329 @@
+#include "JPEGCutThroughSource.hh"
+#include "FrameTrace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+JPEGCutThroughSource* JPEGCutThroughSource::createNew(UsageEnvironment& env, char const* inputName, unsigned framerate)
+{
+  int fd = open(inputName, O_RDONLY | O_NONBLOCK);
+  if (fd < 0)
+  {
+    env.setResultErrMsg("could not open low-latency input ");
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    env.setResultErrMsg("could not stat low-latency input ");
+    ::close(fd);
+    return nullptr;
+  }
+
+  try
+  {
+    return new JPEGCutThroughSource(env, fd, S_ISREG(st.st_mode), framerate);
+  }
+  catch (...)
+  {
+    ::close(fd);
+    return nullptr;
+  }
+}
+
+JPEGCutThroughSource::JPEGCutThroughSource(UsageEnvironment& env, int fd, bool isFile, unsigned framerate)
+    : JPEGVideoSource(env), m_fd(fd), m_isFile(isFile), m_framerate(framerate)
+{
+  m_buffer = FrameBufferPool::instance().acquire(CUT_THROUGH_BUFFER_SZ);
+  if (!m_buffer)
+  {
+    env.setResultErrMsg("could not allocate frame buffer\n");
+    throw std::bad_alloc();
+  }
+  m_frameStart = {0, 0};
+
+  startReading();
+}
+
+JPEGCutThroughSource::~JPEGCutThroughSource()
+{
+  stopReading();
+  envir().taskScheduler().unscheduleDelayedTask(m_resumeTask);
+  ::close(m_fd);
+}
+
+void JPEGCutThroughSource::startReading()
+{
+  if (m_reading || m_resumeTask != nullptr)
+    return;
+  envir().taskScheduler().turnOnBackgroundReadHandling(m_fd, incomingDataHandler, this);
+  m_reading = true;
+}
+
+void JPEGCutThroughSource::stopReading()
+{
+  if (!m_reading)
+    return;
+  envir().taskScheduler().turnOffBackgroundReadHandling(m_fd);
+  m_reading = false;
+}
+
+void JPEGCutThroughSource::incomingDataHandler(void* clientData, int /*mask*/)
+{
+  ((JPEGCutThroughSource*)clientData)->readInput();
+}
+
+void JPEGCutThroughSource::resumeReading(void* clientData)
+{
+  auto* source         = (JPEGCutThroughSource*)clientData;
+  source->m_resumeTask = nullptr;
+
+  /* a plain file stands in for a camera: replay it once per frame interval */
+  if (source->m_isFile)
+    lseek(source->m_fd, 0, SEEK_SET);
+  source->startReading();
+}
+
+void JPEGCutThroughSource::readInput()
+{
+  uint8_t* data     = m_buffer.data();
+  uint32_t capacity = m_buffer.capacity();
+
+  if (m_fill == capacity)
+  {
+    compact();
+    if (m_fill == capacity)
+    {
+      if (m_headerParsed)
+      {
+        /* the sink has not caught up, resume once it asks for more */
+        stopReading();
+        return;
+      }
+
+      fprintf(stderr, "JPEG header does not fit in %u bytes, dropping\n", capacity);
+      m_start   = m_fill;
+      m_soiSeen = false;
+      compact();
+    }
+  }
+
+  /* the bytes read may start the next frame too, they count towards the one in progress */
+  TRACE_SCOPE("read", m_traceId);
+
+  ssize_t n = read(m_fd, data + m_fill, capacity - m_fill);
+  if (n < 0)
+  {
+    if (errno == EAGAIN || errno == EINTR)
+      return;
+    stopReading();
+    handleClosure();
+    return;
+  }
+  if (n == 0)
+  {
+    /* end of file, or no writer on the FIFO: try again in a frame interval */
+    stopReading();
+    m_resumeTask = envir().taskScheduler().scheduleDelayedTask(1000000 / m_framerate, resumeReading, this);
+    return;
+  }
+  m_fill += n;
+
+  if (isCurrentlyAwaitingData() && deliverChunk())
+    FramedSource::afterGetting(this);
+}
+
+bool JPEGCutThroughSource::findFrameStart()
+{
+  uint8_t* data = m_buffer.data();
+
+  while (!m_headerParsed)
+  {
+    if (!m_soiSeen)
+    {
+      uint32_t i = m_start;
+      while (i + 1 < m_fill && !(data[i] == JpegParser::JPEG_MARKER && data[i + 1] == JpegParser::JPEG_MARKER_SOI))
+        i++;
+
+      if (i + 1 >= m_fill)
+      {
+        /* keep a trailing 0xFF, it may start the next SOI */
+        m_start = (m_fill > m_start && data[m_fill - 1] == JpegParser::JPEG_MARKER) ? m_fill - 1 : m_fill;
+        return false;
+      }
+
+      m_start   = i;
+      m_soiSeen = true;
+      gettimeofday(&m_frameStart, nullptr);
+      m_frameStartNs = TRACE_NOW();
+      m_traceId      = TRACE_NEXT_FRAME_ID();
+    }
+
+    uint32_t header = JpegParser::header_size(data + m_start, m_fill - m_start);
+    if (header == 0)
+      return false;
+
+    TRACE_SCOPE("handle_buffer", m_traceId);
+    uint64_t ms = (uint64_t)m_frameStart.tv_sec * 1000 + m_frameStart.tv_usec / 1000;
+    m_quantisation.clear();
+    m_precision = 0;
+    m_payload   = JpegParser::handle_buffer(data + m_start, m_fill - m_start, ms, m_quantisation, m_precision);
+    if (m_payload.payload == nullptr)
+    {
+      /* unusable header, resynchronise on the next SOI */
+      m_start += 2;
+      m_soiSeen = false;
+      continue;
+    }
+
+    m_start += header;
+    m_scan         = m_start;
+    m_eoi          = 0;
+    m_frameOffset  = 0;
+    m_headerParsed = true;
+  }
+
+  return true;
+}
+
+void JPEGCutThroughSource::findEndOfImage()
+{
+  uint8_t* data = m_buffer.data();
+
+  if (m_eoi != 0)
+    return;
+
+  /* 0xFF in entropy-coded data is always stuffed, so FFD9 can only be EOI */
+  uint32_t i = std::max(m_scan, m_start);
+  for (; i + 1 < m_fill; i++)
+  {
+    if (data[i] == JpegParser::JPEG_MARKER && data[i + 1] == JpegParser::JPEG_MARKER_EOI)
+    {
+      m_eoi = i + 2;
+      return;
+    }
+  }
+  m_scan = i;
+}
+
+bool JPEGCutThroughSource::deliverChunk()
+{
+  if (!findFrameStart())
+    return false;
+
+  findEndOfImage();
+
+  uint8_t* data = m_buffer.data();
+  uint32_t end  = m_eoi != 0 ? m_eoi : m_fill;
+
+  /* hold back a trailing 0xFF until we know whether it starts the EOI */
+  if (m_eoi == 0 && end > m_start && data[end - 1] == JpegParser::JPEG_MARKER)
+    end--;
+
+  uint32_t available = end - m_start;
+  if (m_eoi == 0 && available < CUT_THROUGH_MIN_CHUNK)
+    return false;
+
+  uint32_t n = std::min<uint32_t>(available, fMaxSize);
+
+  memcpy(fTo, data + m_start, n);
+  fFrameSize              = n;
+  fNumTruncatedBytes      = 0;
+  fPresentationTime       = m_frameStart;
+  fDurationInMicroseconds = 0;
+
+  m_chunkOffset = m_frameOffset;
+  m_chunkLast   = m_eoi != 0 && m_start + n == m_eoi;
+  TRACE_INSTANT("doGetNextFrame", m_traceId);
+
+  m_start += n;
+  m_frameOffset += n;
+
+  if (m_chunkLast)
+    finishFrame();
+
+  return true;
+}
+
+void JPEGCutThroughSource::finishFrame()
+{
+  TRACE_SINCE("first_byte_to_marker", m_frameStartNs, m_traceId);
+
+  m_soiSeen      = false;
+  m_headerParsed = false;
+  m_eoi          = 0;
+  m_scan         = m_start;
+  compact();
+}
+
+void JPEGCutThroughSource::compact()
+{
+  if (m_start == 0)
+    return;
+
+  uint8_t* data = m_buffer.data();
+  memmove(data, data + m_start, m_fill - m_start);
+
+  m_fill -= m_start;
+  m_scan = m_scan > m_start ? m_scan - m_start : 0;
+  if (m_eoi != 0)
+    m_eoi -= m_start;
+  m_start = 0;
+}
+
+void JPEGCutThroughSource::doGetNextFrame()
+{
+  if (deliverChunk())
+  {
+    nextTask() = envir().taskScheduler().scheduleDelayedTask(0, (TaskFunc*)FramedSource::afterGetting, this);
+    return;
+  }
+
+  /* wait for incomingDataHandler to bring in more of the frame */
+  startReading();
+}
+
+void JPEGCutThroughSource::doStopGettingFrames()
+{
+  envir().taskScheduler().unscheduleDelayedTask(nextTask());
+}
+
+const u_int8_t* JPEGCutThroughSource::quantizationTables(u_int8_t& precision, u_int16_t& length)
+{
+  length    = m_quantisation.size();
+  precision = m_precision;
+  return m_quantisation.data();
+}
+
+u_int16_t JPEGCutThroughSource::restartInterval()
+{
+  return m_payload.restart_interval;
+}
+
+u_int8_t JPEGCutThroughSource::type()
+{
+  return m_payload.type;
+}
+
+u_int8_t JPEGCutThroughSource::qFactor()
+{
+  return m_payload.quality;
+}
+
+u_int8_t JPEGCutThroughSource::width()
+{
+  return m_payload.width;
+}
+
+u_int8_t JPEGCutThroughSource::height()
+{
+  return m_payload.height;
+}
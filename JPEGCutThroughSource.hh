@@ -0,0 +1,111 @@
+#pragma once
+
+#include "FrameBufferPool.h"
+#include "JPEGParser.h"
+#include "JPEGVideoSource.hh"
+
+#include <vector>
+
+// Input buffer; compacted as chunks are sent, so it only has to hold one header plus read-ahead.
+#define CUT_THROUGH_BUFFER_SZ (256 * 1024)
+
+// Smallest run of scan data handed to the sink before EOI, roughly one packet payload.
+#define CUT_THROUGH_MIN_CHUNK 1400
+
+/*
+ * JPEGCutThroughSource:
+ *
+ * Low-latency source for live inputs (a FIFO, pipe or growing file carrying
+ * back-to-back JPEGs). The header up to SOS is parsed as soon as it has
+ * arrived and entropy-coded data is delivered to the sink in chunks as it is
+ * read, so the first packets of a frame leave before its EOI is captured.
+ *
+ * Every chunk of a frame shares the presentation time of the frame's first
+ * byte. JPEGRTPSink uses scanOffset() to continue the RFC 2435 fragment offset
+ * across chunks and only sets the marker bit on the chunk ending at EOI.
+ * With JPEG_TRACE, the time from a frame's first byte to the chunk carrying
+ * its marker is traced as "first_byte_to_marker".
+ */
+class JPEGCutThroughSource : public JPEGVideoSource
+{
+public:
+  static JPEGCutThroughSource* createNew(UsageEnvironment& env, char const* inputName, unsigned framerate);
+
+  // Fragment offset of the first byte of the chunk last delivered.
+  unsigned scanOffset() const
+  {
+    return m_chunkOffset;
+  }
+
+  // True if the chunk last delivered ends the frame.
+  bool frameComplete() const
+  {
+    return m_chunkLast;
+  }
+
+  // FrameTrace id of the frame the chunk last delivered belongs to.
+  uint32_t traceId() const
+  {
+    return m_traceId;
+  }
+
+protected:
+  JPEGCutThroughSource(UsageEnvironment& env, int fd, bool isFile, unsigned framerate);
+  // called only by createNew()
+  virtual ~JPEGCutThroughSource();
+
+private:
+  // redefined virtual functions:
+  virtual void            doGetNextFrame() override;
+  virtual void            doStopGettingFrames() override;
+  virtual u_int8_t        type() override;
+  virtual u_int8_t        qFactor() override;
+  virtual u_int8_t        width() override;
+  virtual u_int8_t        height() override;
+  virtual u_int8_t const* quantizationTables(u_int8_t& precision, u_int16_t& length) override;
+  virtual u_int16_t       restartInterval() override;
+
+private:
+  static void incomingDataHandler(void* clientData, int mask);
+  static void resumeReading(void* clientData);
+
+  void readInput();
+  void startReading();
+  void stopReading();
+  bool deliverChunk();
+  bool findFrameStart();
+  void findEndOfImage();
+  void compact();
+  void finishFrame();
+
+private:
+  JpegParser::RtpJPEGPayload m_payload;
+
+  std::vector<uint8_t> m_quantisation;
+  unsigned             m_precision = 0;
+
+private:
+  int      m_fd;
+  bool     m_isFile;
+  bool     m_reading = false;
+  unsigned m_framerate;
+
+  FrameBuffer m_buffer;
+  uint32_t    m_fill  = 0; // end of valid input in m_buffer
+  uint32_t    m_start = 0; // first byte not yet handed to the sink
+  uint32_t    m_scan  = 0; // next byte to check for EOI
+  uint32_t    m_eoi   = 0; // end of the frame (past FFD9) once seen, else 0
+
+  bool           m_soiSeen      = false;
+  bool           m_headerParsed = false;
+  unsigned       m_frameOffset  = 0; // scan bytes of this frame already delivered
+  struct timeval m_frameStart;       // arrival of the frame's SOI
+  TaskToken      m_resumeTask = nullptr;
+
+  unsigned m_chunkOffset = 0;
+  bool     m_chunkLast   = true;
+
+  // FrameTrace clock at the frame's SOI, for its first-byte-to-marker latency
+  uint64_t m_frameStartNs = 0;
+  uint32_t m_traceId      = 0;
+};
@@ -0,0 +1,322 @@
+#include "JPEGFrameStore.hh"
+#include "FrameTrace.h"
+#include "JPEGFramedSource.hh"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+std::map<std::string, std::weak_ptr<JPEGFrameStore>> JPEGFrameStore::s_stores;
+
+std::shared_ptr<JPEGFrameStore> JPEGFrameStore::lookup(const std::string& fileName)
+{
+  auto it = s_stores.find(fileName);
+  if (it != s_stores.end())
+  {
+    if (auto store = it->second.lock())
+      return store;
+  }
+
+  auto store = std::make_shared<JPEGFrameStore>(fileName, true);
+  if (!store->load())
+    return nullptr;
+
+  forgetExpired();
+  s_stores[fileName] = store;
+  return store;
+}
+
+std::shared_ptr<JPEGFrameStore> JPEGFrameStore::create(const std::string& name)
+{
+  auto it = s_stores.find(name);
+  if (it != s_stores.end())
+  {
+    if (auto store = it->second.lock())
+      return store;
+  }
+
+  forgetExpired();
+  auto store     = std::make_shared<JPEGFrameStore>(name, false);
+  s_stores[name] = store;
+  return store;
+}
+
+std::shared_ptr<JPEGFrameStore> JPEGFrameStore::crop(std::shared_ptr<JPEGFrameStore> source, const JpegCrop::Region& region)
+{
+  std::string name = source->fileName() + "?roi=" + JpegCrop::region_name(region);
+
+  auto it = s_stores.find(name);
+  if (it != s_stores.end())
+  {
+    if (auto store = it->second.lock())
+      return store;
+  }
+
+  forgetExpired();
+  auto store      = std::make_shared<JPEGFrameStore>(name, false);
+  store->m_source = std::move(source);
+  store->m_region = region;
+  s_stores[name]  = store;
+  return store;
+}
+
+void JPEGFrameStore::forgetAll()
+{
+  s_stores.clear();
+}
+
+void JPEGFrameStore::forgetExpired()
+{
+  /* every distinct ?roi= leaves an entry behind once its last client is gone */
+  for (auto it = s_stores.begin(); it != s_stores.end();)
+  {
+    if (it->second.expired())
+      it = s_stores.erase(it);
+    else
+      ++it;
+  }
+}
+
+JPEGFrameStore::JPEGFrameStore(std::string fileName, bool fileBacked)
+    : m_fileName(std::move(fileName)), m_fileBacked(fileBacked)
+{}
+
+bool JPEGFrameStore::refresh()
+{
+  if (m_source)
+    return derive();
+  if (!m_fileBacked)
+    return false;
+
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  long elapsedMs = (now.tv_sec - m_lastPoll.tv_sec) * 1000 + (now.tv_usec - m_lastPoll.tv_usec) / 1000;
+  if (elapsedMs >= 0 && elapsedMs < FRAME_STORE_POLL_MS)
+    return false;
+  m_lastPoll = now;
+
+  return load();
+}
+
+bool JPEGFrameStore::load()
+{
+  struct stat st;
+  if (stat(m_fileName.c_str(), &st) != 0)
+    return false;
+
+  /* snapshot inputs are rewritten in place, only re-read when the file was touched */
+  if (st.st_mtim.tv_sec == m_mtime.tv_sec && st.st_mtim.tv_nsec == m_mtime.tv_nsec && st.st_size == m_size)
+    return false;
+
+  uint32_t traceId = TRACE_NEXT_FRAME_ID();
+  TRACE_SCOPE("read", traceId);
+
+  m_mtime = st.st_mtim;
+  m_size  = st.st_size;
+
+  if (st.st_size == 0)
+  {
+    /* truncated by the writer, look again on the next poll */
+    m_mtime = {0, 0};
+    return false;
+  }
+  if (size_t(st.st_size) > FRAME_STORE_MAX_FILE_SZ)
+  {
+    /* reported once per change of the file, not on every poll */
+    fprintf(stderr,
+            "%s: %ld bytes exceeds the %zu byte frame limit, ignoring\n",
+            m_fileName.c_str(),
+            long(st.st_size),
+            size_t(FRAME_STORE_MAX_FILE_SZ));
+    return false;
+  }
+
+  FILE* fp = fopen(m_fileName.c_str(), "rb");
+  if (fp == nullptr)
+  {
+    m_mtime = {0, 0};
+    return false;
+  }
+
+  FrameBuffer buffer = FrameBufferPool::instance().acquire(st.st_size);
+  if (!buffer)
+  {
+    fclose(fp);
+    m_mtime = {0, 0};
+    return false;
+  }
+  /* a writer growing the file after stat() bumps its mtime, the next poll picks up the rest */
+  uint32_t length = fread(buffer.data(), 1, st.st_size, fp);
+  fclose(fp);
+
+  if (length != uint32_t(st.st_size))
+  {
+    /* truncated under us, look again on the next poll */
+    m_mtime = {0, 0};
+    return false;
+  }
+
+  uint64_t fingerprint = JpegParser::fingerprint(buffer.data(), length);
+  if (m_current && fingerprint == m_current->fingerprint)
+    return false;
+
+  if (!install(std::move(buffer), length, fingerprint, 0, traceId))
+  {
+    /* most likely caught the writer half way, look again on the next poll */
+    m_mtime = {0, 0};
+    return false;
+  }
+  return true;
+}
+
+bool JPEGFrameStore::derive()
+{
+  m_source->refresh();
+
+  std::shared_ptr<const JPEGFrame> frame = m_source->current();
+  if (!frame || m_source->generation() == m_sourceGeneration)
+    return false;
+  m_sourceGeneration = m_source->generation();
+
+  m_cropped.clear();
+  {
+    TRACE_SCOPE("crop", frame->traceId);
+    if (!JpegCrop::crop(
+            frame->buffer.data(), frame->payload, frame->quantisation, frame->precision, m_region, m_cropped))
+      return false;
+  }
+
+  FrameBuffer buffer = FrameBufferPool::instance().acquire(m_cropped.size());
+  if (!buffer)
+    return false;
+  memcpy(buffer.data(), m_cropped.data(), m_cropped.size());
+
+  /* a change outside the region leaves the crop as it was */
+  uint64_t fingerprint = JpegParser::fingerprint(buffer.data(), m_cropped.size());
+  if (m_current && fingerprint == m_current->fingerprint)
+    return false;
+
+  /* the crop is the same frame to the trace, so its events line up with the source's */
+  return install(std::move(buffer), m_cropped.size(), fingerprint, frame->captureTimeUs, frame->traceId);
+}
+
+bool JPEGFrameStore::publish(FrameBuffer buffer, uint32_t length, uint64_t captureTimeUs, uint32_t traceId)
+{
+  uint64_t fingerprint = JpegParser::fingerprint(buffer.data(), length);
+  if (m_current && fingerprint == m_current->fingerprint)
+    return true;
+
+  if (traceId == 0)
+    traceId = TRACE_NEXT_FRAME_ID();
+  return install(std::move(buffer), length, fingerprint, captureTimeUs, traceId);
+}
+
+bool JPEGFrameStore::install(FrameBuffer buffer,
+                             uint32_t    length,
+                             uint64_t    fingerprint,
+                             uint64_t    captureTimeUs,
+                             uint32_t    traceId)
+{
+  auto frame           = std::make_shared<JPEGFrame>();
+  frame->buffer        = std::move(buffer);
+  frame->length        = length;
+  frame->fingerprint   = fingerprint;
+  frame->captureTimeUs = captureTimeUs;
+  frame->traceId       = traceId;
+
+  TRACE_SCOPE("handle_buffer", traceId);
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+  frame->payload = JpegParser::handle_buffer(
+      frame->buffer.data(), frame->length, ms.count(), frame->quantisation, frame->precision);
+  if (frame->payload.payload == nullptr)
+    return false;
+
+  makeCurrent(std::move(frame));
+  return true;
+}
+
+bool JPEGFrameStore::publish(std::shared_ptr<const JPEGFrame> frame)
+{
+  if (!frame || frame->payload.payload == nullptr)
+    return false;
+  if (m_current && frame->fingerprint == m_current->fingerprint)
+    return true;
+
+  makeCurrent(std::move(frame));
+  return true;
+}
+
+void JPEGFrameStore::makeCurrent(std::shared_ptr<const JPEGFrame> frame)
+{
+  if (!m_current || m_current->payload.width != frame->payload.width ||
+      m_current->payload.height != frame->payload.height || m_current->payload.type != frame->payload.type)
+    m_formatGeneration++;
+
+  m_current = std::move(frame);
+  m_generation++;
+}
+
+std::shared_ptr<const JPEGPacketization> JPEGFrame::packetize(unsigned maxPayload) const
+{
+  for (const auto& packetization : packetizations)
+  {
+    if (packetization->maxPayload == maxPayload)
+      return packetization;
+  }
+
+  auto result        = std::make_shared<JPEGPacketization>();
+  result->maxPayload = maxPayload;
+
+  bool restartMarkers = payload.type >= 64 && payload.type <= 127;
+  bool inBandTables   = payload.quality >= 128;
+
+  uint32_t offset = 0;
+  do
+  {
+    std::vector<uint8_t>& h      = result->headers;
+    uint32_t              header = h.size();
+
+    h.insert(h.end(),
+             {0, // type-specific
+              (uint8_t)(offset >> 16),
+              (uint8_t)(offset >> 8),
+              (uint8_t)offset,
+              payload.type,
+              payload.quality,
+              (uint8_t)payload.width,
+              (uint8_t)payload.height});
+
+    if (restartMarkers)
+      h.insert(h.end(),
+               {(uint8_t)(payload.restart_interval >> 8),
+                (uint8_t)payload.restart_interval,
+                0xFF, // F=L=1, restart count 0x3FFF
+                0xFF});
+
+    if (offset == 0 && inBandTables)
+    {
+      h.insert(h.end(),
+               {0, // MBZ
+                (uint8_t)precision,
+                (uint8_t)(quantisation.size() >> 8),
+                (uint8_t)quantisation.size()});
+      h.insert(h.end(), quantisation.begin(), quantisation.end());
+    }
+
+    uint32_t headerSize = h.size() - header;
+    if (headerSize >= maxPayload)
+      return nullptr;
+
+    uint32_t scanSize = std::min<uint32_t>(payload.size - offset, maxPayload - headerSize);
+    result->packets.push_back({header, headerSize, offset, scanSize});
+    offset += scanSize;
+  } while (offset < payload.size);
+
+  if (packetizations.size() < FRAME_MAX_PACKETIZATIONS)
+    packetizations.push_back(result);
+  return result;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "FrameBufferPool.h"
+#include "JPEGCrop.h"
+#include "JPEGParser.h"
+
+#include <sys/time.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Minimum time between two stat() calls on the same input, however many sources poll it.
+#define FRAME_STORE_POLL_MS 10
+
+// Largest input file loaded, the biggest buffer the pool recycles. Larger files are rejected, never truncated.
+#define FRAME_STORE_MAX_FILE_SZ (size_t(1) << FRAME_POOL_MAX_CLASS_SHIFT)
+
+// Packetizations kept per frame, one for each payload size clients are sent with.
+#define FRAME_MAX_PACKETIZATIONS 4
+
+/*
+ * JPEGPacketization:
+ *
+ * A frame cut into RTP/JPEG payloads (RFC 2435) of at most maxPayload bytes.
+ * Each payload is its RTP/JPEG headers (main, restart marker and, in the
+ * first, quantization table header) followed by a slice of the frame's scan
+ * data, which stays in the frame's buffer.
+ */
+struct JPEGPacketization
+{
+  struct Packet
+  {
+    uint32_t header;     // offset of the packet's RTP/JPEG headers in headers
+    uint32_t headerSize;
+    uint32_t scanOffset; // fragment offset, i.e. offset of the slice in the scan data
+    uint32_t scanSize;
+  };
+
+  unsigned             maxPayload = 0;
+  std::vector<uint8_t> headers;
+  std::vector<Packet>  packets;
+};
+
+/*
+ * JPEGFrame:
+ *
+ * A parsed frame as every output path uses it: the file bytes in a pooled
+ * buffer, the RTP/JPEG header fields and the quantisation tables. Immutable
+ * once published, so it can be shared by all sources of a stream; only the
+ * packetization cache grows, on the event loop thread.
+ */
+struct JPEGFrame
+{
+  FrameBuffer                buffer;
+  uint32_t                   length = 0; // bytes of the whole JFIF image in buffer
+  JpegParser::RtpJPEGPayload payload;    // payload points into buffer, at the scan data
+  std::vector<uint8_t>       quantisation;
+  unsigned                   precision     = 0;
+  uint64_t                   fingerprint   = 0;
+  uint64_t                   captureTimeUs = 0; // wall clock, set for frames pushed with a capture time
+  uint32_t                   traceId       = 0; // id of the frame's FrameTrace events, 0 without JPEG_TRACE
+
+  // The frame packetized for payloads of at most maxPayload bytes, built on
+  // first use and shared by every client with that payload size. nullptr if
+  // the headers alone would not fit.
+  std::shared_ptr<const JPEGPacketization> packetize(unsigned maxPayload) const;
+
+  mutable std::vector<std::shared_ptr<const JPEGPacketization>> packetizations;
+};
+
+/*
+ * JPEGFrameStore:
+ *
+ * One per stream. Loads and parses the image once and shares the result
+ * between all sessions of the stream, so SETUP and DESCRIBE do no file I/O.
+ * refresh() re-reads the file when it was touched and bumps generation()
+ * when the content changed, which is what cached SDP is keyed on.
+ *
+ * Stores made with create() have no file behind them; a producer such as
+ * JPEGTestPattern or JPEGStreamer publishes frames into them instead.
+ *
+ * Stores made with crop() follow another store: refresh() cuts the region
+ * out of each new source frame once, for every client of that region.
+ */
+class JPEGFrameStore
+{
+public:
+  // Returns the store for fileName, creating and loading it on first use; nullptr if it cannot be loaded.
+  static std::shared_ptr<JPEGFrameStore> lookup(const std::string& fileName);
+
+  // Returns the store named name, creating an empty one fed through publish() if there is none.
+  static std::shared_ptr<JPEGFrameStore> create(const std::string& name);
+
+  // Returns the store of region of source, named "<source>?roi=x,y,w,h"; see JpegCrop::crop().
+  static std::shared_ptr<JPEGFrameStore> crop(std::shared_ptr<JPEGFrameStore> source, const JpegCrop::Region& region);
+
+  // In a forked worker: forgets the parent's stores, so that lookup() and create() make the worker's own.
+  static void forgetAll();
+
+  // Parses length bytes of buffer and makes them the current frame, returns false if they are not a usable JPEG.
+  // traceId is the id the frame's earlier trace events used; 0 takes a new one.
+  bool publish(FrameBuffer buffer, uint32_t length, uint64_t captureTimeUs = 0, uint32_t traceId = 0);
+
+  // Makes a frame that was parsed elsewhere (e.g. by another process, see SharedFrameRing) the current frame.
+  bool publish(std::shared_ptr<const JPEGFrame> frame);
+
+  // Re-reads the input if it changed on disk (or crops a new source frame), returns true if a new frame was published.
+  bool refresh();
+
+  std::shared_ptr<const JPEGFrame> current() const
+  {
+    return m_current;
+  }
+
+  unsigned generation() const
+  {
+    return m_generation;
+  }
+
+  // Bumped only when the stream's format (dimensions, type) changes, not on every new frame.
+  unsigned formatGeneration() const
+  {
+    return m_formatGeneration;
+  }
+
+  const std::string& fileName() const
+  {
+    return m_fileName;
+  }
+
+  JPEGFrameStore(std::string fileName, bool fileBacked);
+
+private:
+  bool load();
+  bool derive();
+  bool install(FrameBuffer buffer, uint32_t length, uint64_t fingerprint, uint64_t captureTimeUs, uint32_t traceId);
+  void makeCurrent(std::shared_ptr<const JPEGFrame> frame);
+
+  // Drops the s_stores entries of stores nobody holds any more.
+  static void forgetExpired();
+
+private:
+  std::string                      m_fileName;
+  bool                             m_fileBacked;
+  std::shared_ptr<const JPEGFrame> m_current;
+  unsigned                         m_generation       = 0;
+  unsigned                         m_formatGeneration = 0;
+  struct timespec                  m_mtime      = {0, 0};
+  off_t                            m_size       = -1;
+  struct timeval                   m_lastPoll   = {0, 0};
+
+  // set for crop() stores
+  std::shared_ptr<JPEGFrameStore> m_source;
+  JpegCrop::Region                m_region;
+  unsigned                        m_sourceGeneration = 0;
+  std::vector<uint8_t>            m_cropped; // scratch, kept to reuse its allocation
+
+  static std::map<std::string, std::weak_ptr<JPEGFrameStore>> s_stores;
+};
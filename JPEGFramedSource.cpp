@@ -1,21 +1,23 @@
 #include "JPEGFramedSource.hh"
-#include <sys/mman.h>
 #include <sys/time.h>
 
 #include <algorithm>
 #include <chrono>
 #include <string>
-#include <thread>
 
+#include "FrameTrace.h"
+#include "JPEGCutThroughSource.hh"
 #include "JPEGParser.h"
+#include "OverloadControl.hh"
 
-#define IMAGE "test.jpg"
-
-JPEGFramedSource* JPEGFramedSource::createNew(UsageEnvironment& env, unsigned framerate)
+JPEGFramedSource* JPEGFramedSource::createNew(UsageEnvironment&               env,
+                                              std::shared_ptr<JPEGFrameStore> store,
+                                              unsigned                        framerate,
+                                              unsigned                        keepAliveMs)
 {
   try
   {
-    return new JPEGFramedSource(env, framerate);
+    return new JPEGFramedSource(env, std::move(store), framerate, keepAliveMs);
   }
   catch (...)
   {
@@ -23,112 +25,231 @@ JPEGFramedSource* JPEGFramedSource::createNew(UsageEnvironment& env, unsigned fr
   }
 }
 
-JPEGFramedSource ::JPEGFramedSource(UsageEnvironment& env, unsigned int framerate)
-    : JPEGVideoSource(env), m_framerate(framerate)
+JPEGFramedSource ::JPEGFramedSource(UsageEnvironment&               env,
+                                    std::shared_ptr<JPEGFrameStore> store,
+                                    unsigned int                    framerate,
+                                    unsigned                        keepAliveMs)
+    : JPEGPacketSource(env), m_store(std::move(store)), m_framerate(framerate), m_keepAliveUs((uint64_t)keepAliveMs * 1000)
 {
-  jpeg_dat = new unsigned char[MAX_JPEG_FILE_SZ];
-  FILE* fp = fopen(IMAGE, "rb");
-  if (fp == nullptr)
+  if (!m_store || !m_store->current())
   {
-    env.setResultErrMsg("could not open " IMAGE "\n");
+    env.setResultErrMsg("no frame in store\n");
     throw DeviceException();
   }
-  else
+
+  m_frame = m_store->current();
+}
+
+JPEGFramedSource::~JPEGFramedSource() = default;
+
+void JPEGFramedSource::doGetNextFrame()
+{
+  /* the packets of a frame go out back to back, the sink asks for the next frame as soon as one is sent */
+  if (m_packets && m_nextPacket < m_packets->packets.size())
   {
-    printf("Successfully opened: " IMAGE "\n");
+    deliverPacket();
+    return;
   }
-  jpeg_datlen = fread(jpeg_dat, 1, MAX_JPEG_FILE_SZ, fp);
-  fclose(fp);
 
-  // We need to parse first, to ensure all quants are correct
-  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-  m_quantisation.clear();
-  m_payload = JpegParser::handle_buffer(jpeg_dat, jpeg_datlen, ms.count(), m_quantisation, m_precision);
+  // The source paces the stream itself
+  scheduleNextFrame();
 }
 
-JPEGFramedSource::~JPEGFramedSource()
+void JPEGFramedSource::scheduleNextFrame()
 {
-  delete[] jpeg_dat;
+  unsigned interval = OverloadGovernor::instance().frameInterval(1000000 / m_framerate);
+  nextTask()        = envir().taskScheduler().scheduleDelayedTask(interval, deliverFrame, this);
 }
 
-static struct timezone Idunno;
-
-void JPEGFramedSource::doGetNextFrame()
+void JPEGFramedSource::deliverFrame(void* clientData)
 {
-  std::this_thread::sleep_for(std::chrono::milliseconds(1000 / m_framerate));
+  ((JPEGFramedSource*)clientData)->deliverFrame();
+}
 
+void JPEGFramedSource::deliverFrame()
+{
   auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+  uint64_t now = ms.count();
 
-  m_quantisation.clear();
-  m_payload = JpegParser::handle_buffer(jpeg_dat, jpeg_datlen, ms.count(), m_quantisation, m_precision);
+  m_store->refresh();
+  m_frame = m_store->current();
 
-  if (m_payload.size <= fMaxSize)
+  /* unchanged content only goes out at the keep-alive rate, a change is sent on the next tick */
+  bool changed = m_frame->fingerprint != m_sentFingerprint;
+  if (!changed && m_keepAliveUs != 0 && m_last_pts != 0 && (now - std::min(now, m_last_pts)) * 1000 < m_keepAliveUs)
   {
-    fNumTruncatedBytes = 0;
-    fFrameSize         = m_payload.size;
+    scheduleNextFrame();
+    return;
+  }
 
-    memcpy(fTo, m_payload.payload, m_payload.size);
-    // fTo = m_payload.payload;
+  /* a client that is not draining its socket skips whole frames rather than queueing stale ones */
+  if (m_sink != nullptr && sendQueueCongested(m_sink->groupsockBeingUsed().socketNum()))
+  {
+    scheduleNextFrame();
+    return;
+  }
 
-    uint64_t ts = m_payload.timestamp;
-    if (m_last_pts == 0)
-      m_last_pts = ts;
+  m_packets = m_frame->packetize(maxPayload());
+  if (!m_packets)
+  {
+    envir() << "JPEGFramedSource: frame headers do not fit a " << maxPayload() << " byte payload\n";
+    scheduleNextFrame();
+    return;
+  }
+  m_nextPacket = 0;
 
-    fPresentationTime.tv_sec = (long)ts / 1000;
-    ts -= fPresentationTime.tv_sec * 1000;
-    fPresentationTime.tv_usec = (long)ts * 1000;
-    fDurationInMicroseconds   = (unsigned int)(m_payload.timestamp - m_last_pts) * 1000;
+  /* a pushed frame goes out with its capture time, clamped so that timestamps never run backwards */
+  uint64_t ts = (changed && m_frame->captureTimeUs != 0) ? m_frame->captureTimeUs / 1000 : now;
+  if (m_last_pts != 0 && ts <= m_last_pts)
+    ts = m_last_pts + 1;
 
-    m_last_pts = m_payload.timestamp;
-  }
-  else
+  m_last_pts = ts;
+
+  fPresentationTime.tv_sec = (long)ts / 1000;
+  ts -= fPresentationTime.tv_sec * 1000;
+  fPresentationTime.tv_usec = (long)ts * 1000;
+  fDurationInMicroseconds   = 0;
+  m_traceId                 = m_frame->traceId;
+  TRACE_INSTANT("doGetNextFrame", m_traceId);
+
+  m_sentFingerprint = m_frame->fingerprint;
+
+  /* RTP-over-RTSP: the sink writes the whole frame itself, a batch of packets per system call */
+  if (m_sink != nullptr && m_sink->interleaved())
   {
-    fprintf(stderr, "fMaxSize is too small!");
-    fFrameSize = 0;
+    m_sink->sendFrame(m_frame, m_packets, fPresentationTime);
+    m_nextPacket = m_packets->packets.size();
+    scheduleNextFrame();
+    return;
   }
 
-  // Switch to another task, and inform the reader that he has data:
-  nextTask() = envir().taskScheduler().scheduleDelayedTask(0, (TaskFunc*)FramedSource::afterGetting, this);
+  deliverPacket();
 }
 
-const u_int8_t* JPEGFramedSource::quantizationTables(u_int8_t& precision, u_int16_t& length)
+void JPEGFramedSource::deliverPacket()
 {
-  length    = m_quantisation.size();
-  precision = m_precision;
-  return m_quantisation.data();
+  const JPEGPacketization::Packet& packet = m_packets->packets[m_nextPacket++];
+
+  /* fMaxSize is the room left in the sink's buffer, which always holds at least one whole packet */
+  uint32_t headerSize = std::min<uint32_t>(packet.headerSize, fMaxSize);
+  uint32_t scanSize   = std::min<uint32_t>(packet.scanSize, fMaxSize - headerSize);
+  memcpy(fTo, m_packets->headers.data() + packet.header, headerSize);
+  memcpy(fTo + headerSize, m_frame->payload.payload + packet.scanOffset, scanSize);
+
+  fFrameSize         = headerSize + scanSize;
+  fNumTruncatedBytes = packet.headerSize + packet.scanSize - fFrameSize;
+  m_marker           = m_nextPacket == m_packets->packets.size();
+
+  // Inform the reader that he has data:
+  TRACE_SCOPE("afterGetting", m_traceId);
+  FramedSource::afterGetting(this);
 }
 
-u_int8_t JPEGFramedSource::type()
+// JPEGRTPSink
+
+JPEGRTPSink* JPEGRTPSink::createNew(UsageEnvironment& env, Groupsock* RTPgs, JPEGCutThroughSource* cutThrough)
 {
-  return m_payload.type;
+  return new JPEGRTPSink(env, RTPgs, cutThrough);
 }
 
-u_int8_t JPEGFramedSource::qFactor()
+JPEGRTPSink::~JPEGRTPSink()
 {
-  return m_payload.quality;
-}
+  printf("~JPEGRTPSink()\n");
+};
 
-u_int8_t JPEGFramedSource::width()
+JPEGRTPSink::JPEGRTPSink(UsageEnvironment& env, Groupsock* RTPgs, JPEGCutThroughSource* cutThrough)
+    : JPEGVideoRTPSink(env, RTPgs), m_cutThrough(cutThrough)
+{}
+
+unsigned JPEGRTPSink::scanOffset(unsigned fragmentationOffset) const
 {
-  return m_payload.width;
+  return m_cutThrough ? m_cutThrough->scanOffset() + fragmentationOffset : fragmentationOffset;
 }
 
-u_int8_t JPEGFramedSource::height()
+// Same headers as JPEGVideoRTPSink (RFC 2435 3.1), except that the fragment offset and
+// marker bit follow the whole scan when the source hands it over in several chunks.
+void JPEGRTPSink::doSpecialFrameHandling(unsigned /*fragmentationOffset*/,
+                                         unsigned char* /*frameStart*/,
+                                         unsigned /*numBytesInFrame*/,
+                                         struct timeval framePresentationTime,
+                                         unsigned       numRemainingBytes)
 {
-  return m_payload.height;
-}
+  auto* source = (JPEGVideoSource*)fSource;
+  if (source == nullptr)
+    return;
+
+  TRACE_INSTANT("packet", m_cutThrough != nullptr ? m_cutThrough->traceId() : 0);
+
+  unsigned offset = scanOffset(curFragmentationOffset());
+  u_int8_t type   = source->type();
+
+  u_int8_t mainJPEGHeader[8];
+  mainJPEGHeader[0] = 0; // type-specific
+  mainJPEGHeader[1] = offset >> 16;
+  mainJPEGHeader[2] = offset >> 8;
+  mainJPEGHeader[3] = offset;
+  mainJPEGHeader[4] = type;
+  mainJPEGHeader[5] = source->qFactor();
+  mainJPEGHeader[6] = source->width();
+  mainJPEGHeader[7] = source->height();
+  setSpecialHeaderBytes(mainJPEGHeader, sizeof mainJPEGHeader);
+
+  unsigned restartMarkerHeaderSize = 0;
+  if (type >= 64 && type <= 127)
+  {
+    u_int16_t restartInterval = source->restartInterval();
+    u_int8_t  restartMarkerHeader[4];
+
+    restartMarkerHeaderSize = sizeof restartMarkerHeader;
+    restartMarkerHeader[0]  = restartInterval >> 8;
+    restartMarkerHeader[1]  = restartInterval & 0xFF;
+    restartMarkerHeader[2]  = 0xFF; // F=L=1, restart count 0x3FFF
+    restartMarkerHeader[3]  = 0xFF;
+    setSpecialHeaderBytes(restartMarkerHeader, restartMarkerHeaderSize, sizeof mainJPEGHeader);
+  }
 
-// JPEGRTPSink
+  if (offset == 0 && source->qFactor() >= 128)
+  {
+    u_int8_t        precision;
+    u_int16_t       length;
+    u_int8_t const* tables = source->quantizationTables(precision, length);
+    u_int8_t        quantizationHeader[4];
+
+    quantizationHeader[0] = 0; // MBZ
+    quantizationHeader[1] = precision;
+    quantizationHeader[2] = length >> 8;
+    quantizationHeader[3] = length & 0xFF;
+    setSpecialHeaderBytes(quantizationHeader, sizeof quantizationHeader, sizeof mainJPEGHeader + restartMarkerHeaderSize);
+    if (tables != nullptr)
+      setSpecialHeaderBytes(tables, length, sizeof mainJPEGHeader + restartMarkerHeaderSize + sizeof quantizationHeader);
+  }
 
-JPEGRTPSink* JPEGRTPSink::createNew(UsageEnvironment& env, Groupsock* RTPgs)
-{
-  return new JPEGRTPSink(env, RTPgs);
+  if (numRemainingBytes == 0 && (m_cutThrough == nullptr || m_cutThrough->frameComplete()))
+    setMarkerBit();
+
+  setTimestamp(framePresentationTime);
 }
 
-JPEGRTPSink::~JPEGRTPSink()
+unsigned JPEGRTPSink::specialHeaderSize() const
 {
-  printf("~JPEGRTPSink()\n");
-};
+  auto* source = (JPEGVideoSource*)fSource;
+  if (source == nullptr)
+    return 0;
 
-JPEGRTPSink::JPEGRTPSink(UsageEnvironment& env, Groupsock* RTPgs) : JPEGVideoRTPSink(env, RTPgs) {}
+  unsigned headerSize = 8;
+
+  u_int8_t type = source->type();
+  if (type >= 64 && type <= 127)
+    headerSize += 4;
+
+  if (scanOffset(curFragmentationOffset()) == 0 && source->qFactor() >= 128)
+  {
+    u_int8_t  precision;
+    u_int16_t length;
+    (void)source->quantizationTables(precision, length);
+    headerSize += 4 + length;
+  }
+
+  return headerSize;
+}
 
@@ -1,59 +1,94 @@
 #pragma once
 
+#include "JPEGFrameStore.hh"
+#include "JPEGPacketSink.hh"
 #include "JPEGParser.h"
-#include "JPEGVideoSource.hh"
 
 #include <JPEGVideoRTPSink.hh>
 #include <SimpleRTPSink.hh>
 #include <VideoRTPSink.hh>
 #include <exception>
+#include <memory>
 #include <vector>
 
-#define MAX_JPEG_FILE_SZ 200000
-
 class DeviceException : public std::exception
 {};
 
-class JPEGFramedSource : public JPEGVideoSource
+/*
+ * JPEGFramedSource:
+ *
+ * Serves a JPEGFrameStore's current frame at the stream's frame rate. Frames
+ * go out as the payloads of the frame's cached packetization for the sink's
+ * packet size, so the RTP/JPEG headers and fragment boundaries are worked out
+ * once per frame rather than once per client, and frames of any size fit.
+ */
+class JPEGFramedSource : public JPEGPacketSource
 {
 public:
-  static JPEGFramedSource* createNew(UsageEnvironment& env, unsigned timePerFrame);
+  // keepAliveMs > 0 suppresses frames whose content has not changed, sending them only
+  // once per keepAliveMs so players keep receiving timestamps. 0 sends every frame.
+  static JPEGFramedSource* createNew(UsageEnvironment&               env,
+                                     std::shared_ptr<JPEGFrameStore> store,
+                                     unsigned                        timePerFrame,
+                                     unsigned                        keepAliveMs = 0);
 
 protected:
-  explicit JPEGFramedSource(UsageEnvironment& env, unsigned int framerate);
+  JPEGFramedSource(UsageEnvironment&               env,
+                   std::shared_ptr<JPEGFrameStore> store,
+                   unsigned int                    framerate,
+                   unsigned                        keepAliveMs);
   // called only by createNew()
   virtual ~JPEGFramedSource();
 
 private:
   // redefined virtual functions:
-  virtual void            doGetNextFrame() override;
-  virtual u_int8_t        type() override;
-  virtual u_int8_t        qFactor() override;
-  virtual u_int8_t        width() override;
-  virtual u_int8_t        height() override;
-  virtual u_int8_t const* quantizationTables(u_int8_t& precision, u_int16_t& length) override;
+  virtual void doGetNextFrame() override;
 
 private:
-  JpegParser::RtpJPEGPayload m_payload;
+  static void deliverFrame(void* clientData);
+  void        deliverFrame();
+  void        deliverPacket();
+  void        scheduleNextFrame();
 
-  std::vector<uint8_t> m_quantisation;
-  unsigned             m_precision;
+private:
+  std::shared_ptr<JPEGFrameStore> m_store;
+  // frame being sent, kept until its last packet has gone out
+  std::shared_ptr<const JPEGFrame>         m_frame;
+  std::shared_ptr<const JPEGPacketization> m_packets;
+  unsigned                                 m_nextPacket = 0;
 
 private:
-  unsigned char* jpeg_dat;
-  size_t         jpeg_datlen;
-  uint64_t       m_last_pts = 0;
-  unsigned int   m_framerate;
+  uint64_t     m_last_pts        = 0;
+  uint64_t     m_sentFingerprint = 0;
+  unsigned int m_framerate;
+  uint64_t     m_keepAliveUs;
 };
 
+class JPEGCutThroughSource;
+
 class JPEGRTPSink : public JPEGVideoRTPSink
 {
 public:
-  static JPEGRTPSink* createNew(UsageEnvironment& env, Groupsock* RTPgs);
+  // cutThrough is the stream's source when it delivers frames in chunks, otherwise nullptr
+  static JPEGRTPSink* createNew(UsageEnvironment& env, Groupsock* RTPgs, JPEGCutThroughSource* cutThrough = nullptr);
 
   ~JPEGRTPSink() override;
 
 protected:
-  JPEGRTPSink(UsageEnvironment& env, Groupsock* RTPgs);
+  JPEGRTPSink(UsageEnvironment& env, Groupsock* RTPgs, JPEGCutThroughSource* cutThrough);
+
+private:
+  // redefined virtual functions:
+  virtual void     doSpecialFrameHandling(unsigned       fragmentationOffset,
+                                          unsigned char* frameStart,
+                                          unsigned       numBytesInFrame,
+                                          struct timeval framePresentationTime,
+                                          unsigned       numRemainingBytes) override;
+  virtual unsigned specialHeaderSize() const override;
 
+  // offset of the current packet's first byte within the whole scan
+  unsigned scanOffset(unsigned fragmentationOffset) const;
+
+private:
+  JPEGCutThroughSource* m_cutThrough;
 };
@@ -0,0 +1,387 @@
+#include "JPEGHTTPServer.hh"
+#include "FrameTrace.h"
+#include "JPEGRTSPServer.hh"
+#include "OverloadControl.hh"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+std::unique_ptr<JPEGHTTPServer> JPEGHTTPServer::createNew(UsageEnvironment& env,
+                                                          uint16_t          port,
+                                                          unsigned          framerate,
+                                                          bool              sharePort)
+{
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    env.setResultErrMsg("could not create HTTP socket: ");
+    return nullptr;
+  }
+
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+  if (sharePort)
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof reuse);
+
+  struct sockaddr_in addr = {};
+  addr.sin_family         = AF_INET;
+  addr.sin_addr.s_addr    = htonl(INADDR_ANY);
+  addr.sin_port           = htons(port);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof addr) != 0 || listen(fd, SOMAXCONN) != 0)
+  {
+    env.setResultErrMsg("could not listen for HTTP: ");
+    ::close(fd);
+    return nullptr;
+  }
+
+  return std::unique_ptr<JPEGHTTPServer>(new JPEGHTTPServer(env, fd, framerate));
+}
+
+JPEGHTTPServer::JPEGHTTPServer(UsageEnvironment& env, int socket, unsigned framerate)
+    : m_env(env), m_socket(socket), m_framerate(framerate)
+{
+  m_env.taskScheduler().setBackgroundHandling(m_socket, SOCKET_READABLE, incomingConnection, this);
+  scheduleTick();
+}
+
+JPEGHTTPServer::~JPEGHTTPServer()
+{
+  m_env.taskScheduler().unscheduleDelayedTask(m_tickTask);
+
+  while (!m_connections.empty())
+    closeConnection(m_connections.begin()->second.get());
+
+  m_env.taskScheduler().disableBackgroundHandling(m_socket);
+  ::close(m_socket);
+}
+
+void JPEGHTTPServer::addStream(const std::string& name, std::shared_ptr<JPEGFrameStore> store)
+{
+  if (!store)
+    return;
+  if (m_streams.empty())
+    m_defaultStream = name;
+  m_streams[name] = std::move(store);
+}
+
+std::shared_ptr<JPEGFrameStore> JPEGHTTPServer::regionStore(std::shared_ptr<JPEGFrameStore> source,
+                                                            const JpegCrop::Region&         region)
+{
+  std::shared_ptr<JPEGFrameStore> store = JPEGFrameStore::crop(std::move(source), region);
+  if (std::find(m_regionStores.begin(), m_regionStores.end(), store) != m_regionStores.end())
+    return store;
+
+  /* the same limit as for RTSP region streams: drop the oldest region no connection is on */
+  if (m_regionStores.size() >= RTSP_MAX_REGION_STREAMS)
+  {
+    auto unused = std::find_if(m_regionStores.begin(),
+                               m_regionStores.end(),
+                               [](const std::shared_ptr<JPEGFrameStore>& regionStore)
+                               { return regionStore.use_count() == 1; });
+    if (unused == m_regionStores.end())
+      return nullptr;
+    m_regionStores.erase(unused);
+  }
+
+  m_regionStores.push_back(store);
+  return store;
+}
+
+void JPEGHTTPServer::incomingConnection(void* clientData, int /*mask*/)
+{
+  auto* server = (JPEGHTTPServer*)clientData;
+
+  int fd;
+  while ((fd = accept4(server->m_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+  {
+    if (server->m_connections.size() >= HTTP_MAX_CONNECTIONS)
+    {
+      ::close(fd);
+      continue;
+    }
+
+    auto conn    = std::make_unique<Connection>();
+    conn->server = server;
+    conn->fd     = fd;
+    server->m_env.taskScheduler().setBackgroundHandling(fd, SOCKET_READABLE, incomingData, conn.get());
+    server->m_connections[fd] = std::move(conn);
+  }
+}
+
+void JPEGHTTPServer::incomingData(void* clientData, int mask)
+{
+  auto*           conn   = (Connection*)clientData;
+  JPEGHTTPServer* server = conn->server;
+
+  if (mask & SOCKET_WRITABLE)
+  {
+    server->continueWriting(conn);
+    return;
+  }
+
+  char    buf[1024];
+  ssize_t n = read(conn->fd, buf, sizeof buf);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+  {
+    server->closeConnection(conn);
+    return;
+  }
+  if (n < 0)
+    return;
+
+  /* anything a client sends once it has been answered is ignored */
+  if (conn->store || conn->iovCount > 0)
+    return;
+
+  conn->request.append(buf, n);
+  if (conn->request.find("\r\n\r\n") != std::string::npos)
+    server->handleRequest(conn);
+  else if (conn->request.size() > HTTP_MAX_REQUEST_SZ)
+    server->closeConnection(conn);
+}
+
+void JPEGHTTPServer::handleRequest(Connection* conn)
+{
+  char method[8], path[256];
+  if (sscanf(conn->request.c_str(), "%7s %255s HTTP/", method, path) != 2)
+  {
+    respond(conn, "400 Bad Request", "");
+    return;
+  }
+  if (strcmp(method, "GET") != 0)
+  {
+    respond(conn, "405 Method Not Allowed", "Allow: GET\r\n");
+    return;
+  }
+
+  /* /<stream>/<resource>, or /<resource> for the default stream */
+  char* query = strchr(path, '?');
+  if (query != nullptr)
+    *query = '\0';
+
+  std::string stream   = m_defaultStream;
+  const char* resource = path + 1;
+  if (const char* slash = strrchr(resource, '/'))
+  {
+    stream.assign(resource, slash - resource);
+    resource = slash + 1;
+  }
+
+  auto it = m_streams.find(stream);
+  if (it == m_streams.end() || (strcmp(resource, "mjpeg") != 0 && strcmp(resource, "snapshot.jpg") != 0))
+  {
+    respond(conn, "404 Not Found", "");
+    return;
+  }
+
+  /* ?roi=x,y,w,h serves a crop, shared with every other client of the same region */
+  std::shared_ptr<JPEGFrameStore> store = it->second;
+  if (query != nullptr && strncmp(query + 1, "roi=", 4) == 0)
+  {
+    JpegCrop::Region region;
+    if (!JpegCrop::parse_region(query + 5, region))
+    {
+      respond(conn, "400 Bad Request", "");
+      return;
+    }
+    store = regionStore(store, region);
+    if (!store)
+    {
+      respond(conn, "503 Service Unavailable", "");
+      return;
+    }
+
+    store->refresh();
+    if (it->second->current() && !store->current())
+    {
+      respond(conn, "400 Bad Request", "");
+      return;
+    }
+  }
+
+  if (strcmp(resource, "mjpeg") == 0)
+  {
+    /* the response header goes out with the first part, see tick() */
+    conn->store = store;
+    conn->head  = "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: multipart/x-mixed-replace; boundary=" HTTP_MJPEG_BOUNDARY "\r\n"
+                 "Cache-Control: no-cache\r\n"
+                 "Connection: close\r\n"
+                 "\r\n";
+    return;
+  }
+
+  store->refresh();
+  std::shared_ptr<const JPEGFrame> frame = store->current();
+  if (!frame)
+  {
+    respond(conn, "503 Service Unavailable", "");
+    return;
+  }
+
+  char etag[32];
+  snprintf(etag, sizeof etag, "\"%016llx\"", (unsigned long long)frame->fingerprint);
+
+  /* If-None-Match may list several tags, a plain substring match covers them all */
+  const char* ifNoneMatch = strcasestr(conn->request.c_str(), "\r\nIf-None-Match:");
+  if (ifNoneMatch != nullptr)
+  {
+    const char* end = strstr(ifNoneMatch + 2, "\r\n");
+    if (std::string(ifNoneMatch, end).find(etag) != std::string::npos)
+    {
+      std::string headers = std::string("ETag: ") + etag + "\r\n";
+      respond(conn, "304 Not Modified", headers.c_str());
+      return;
+    }
+  }
+
+  char head[256];
+  snprintf(head,
+           sizeof head,
+           "HTTP/1.1 200 OK\r\n"
+           "Content-Type: image/jpeg\r\n"
+           "Content-Length: %u\r\n"
+           "ETag: %s\r\n"
+           "Cache-Control: no-cache\r\n"
+           "Connection: close\r\n"
+           "\r\n",
+           frame->length,
+           etag);
+  conn->head          = head;
+  conn->closeWhenSent = true;
+  startWrite(conn, std::move(frame));
+}
+
+void JPEGHTTPServer::respond(Connection* conn, const char* status, const char* extraHeaders)
+{
+  conn->head = std::string("HTTP/1.1 ") + status + "\r\n" + extraHeaders + "Content-Length: 0\r\nConnection: close\r\n\r\n";
+  conn->closeWhenSent = true;
+  startWrite(conn, nullptr);
+}
+
+void JPEGHTTPServer::startWrite(Connection* conn, std::shared_ptr<const JPEGFrame> frame)
+{
+  conn->frame    = std::move(frame);
+  conn->iovIndex = 0;
+  conn->iovCount = 0;
+
+  conn->iov[conn->iovCount++] = {(void*)conn->head.data(), conn->head.size()};
+  if (conn->frame)
+  {
+    conn->iov[conn->iovCount++] = {conn->frame->buffer.data(), conn->frame->length};
+    if (conn->store)
+      conn->iov[conn->iovCount++] = {(void*)"\r\n", 2};
+  }
+
+  continueWriting(conn);
+}
+
+void JPEGHTTPServer::continueWriting(Connection* conn)
+{
+  while (conn->iovIndex < conn->iovCount)
+  {
+    struct msghdr msg = {};
+    msg.msg_iov       = conn->iov + conn->iovIndex;
+    msg.msg_iovlen    = conn->iovCount - conn->iovIndex;
+
+    ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+      {
+        m_env.taskScheduler().setBackgroundHandling(
+            conn->fd, SOCKET_READABLE | SOCKET_WRITABLE, incomingData, conn);
+        return;
+      }
+      closeConnection(conn);
+      return;
+    }
+
+    while (n > 0)
+    {
+      struct iovec& iov = conn->iov[conn->iovIndex];
+      size_t        len = std::min((size_t)n, iov.iov_len);
+      iov.iov_base      = (uint8_t*)iov.iov_base + len;
+      iov.iov_len -= len;
+      n -= len;
+      if (iov.iov_len == 0)
+        conn->iovIndex++;
+    }
+  }
+
+  conn->iovCount = 0;
+  conn->frame.reset();
+  if (conn->closeWhenSent)
+  {
+    closeConnection(conn);
+    return;
+  }
+  m_env.taskScheduler().setBackgroundHandling(conn->fd, SOCKET_READABLE, incomingData, conn);
+}
+
+void JPEGHTTPServer::closeConnection(Connection* conn)
+{
+  int fd = conn->fd;
+  m_env.taskScheduler().disableBackgroundHandling(fd);
+  ::close(fd);
+  m_connections.erase(fd);
+}
+
+void JPEGHTTPServer::scheduleTick()
+{
+  m_tickTask = m_env.taskScheduler().scheduleDelayedTask(
+      OverloadGovernor::instance().frameInterval(1000000 / m_framerate), tick, this);
+}
+
+void JPEGHTTPServer::tick(void* clientData)
+{
+  ((JPEGHTTPServer*)clientData)->tick();
+}
+
+void JPEGHTTPServer::tick()
+{
+  scheduleTick();
+
+  for (auto& entry : m_streams)
+    entry.second->refresh();
+
+  for (auto it = m_connections.begin(); it != m_connections.end();)
+  {
+    /* startWrite() may close the connection */
+    Connection* conn = (it++)->second.get();
+
+    if (!conn->store || conn->iovCount > 0 || sendQueueCongested(conn->fd))
+      continue;
+
+    /* crop stores are not in m_streams, see handleRequest() */
+    conn->store->refresh();
+
+    std::shared_ptr<const JPEGFrame> frame = conn->store->current();
+    if (!frame || conn->store->generation() == conn->sentGeneration)
+      continue;
+    conn->sentGeneration = conn->store->generation();
+
+    char part[128];
+    snprintf(part,
+             sizeof part,
+             "--" HTTP_MJPEG_BOUNDARY "\r\n"
+             "Content-Type: image/jpeg\r\n"
+             "Content-Length: %u\r\n"
+             "\r\n",
+             frame->length);
+    /* the first part goes out behind the response header */
+    conn->head = conn->partsSent++ == 0 ? conn->head + part : std::string(part);
+
+    TRACE_INSTANT("http_frame", frame->traceId);
+    startWrite(conn, std::move(frame));
+  }
+}
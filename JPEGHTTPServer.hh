@@ -0,0 +1,104 @@
+#pragma once
+
+#include "JPEGFrameStore.hh"
+
+#include <UsageEnvironment.hh>
+
+#include <sys/uio.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Request header bytes accepted before the connection is dropped.
+#define HTTP_MAX_REQUEST_SZ 4096
+
+// Connections served at once; any more are closed right after accept().
+#define HTTP_MAX_CONNECTIONS 64
+
+// Separates the parts of a multipart/x-mixed-replace MJPEG response.
+#define HTTP_MJPEG_BOUNDARY "jpegstreamerframe"
+
+/*
+ * JPEGHTTPServer:
+ *
+ * HTTP output for browsers and NVRs that want MJPEG rather than RTSP, running
+ * on the same scheduler as the RTSP server. For every stream added:
+ *
+ *   GET /<stream>/mjpeg         multipart/x-mixed-replace MJPEG
+ *   GET /<stream>/snapshot.jpg  the current frame, answering If-None-Match with 304
+ *
+ * The first stream added is also served as /mjpeg and /snapshot.jpg. Either
+ * resource takes ?roi=x,y,w,h to serve a crop of the stream instead; at most
+ * RTSP_MAX_REGION_STREAMS regions are kept, as for RTSP.
+ *
+ * Bodies are written with one gather write straight from the frame store's
+ * pooled buffer, which the connection keeps a reference to until it is sent.
+ * An MJPEG client whose previous frame has not drained, or whose kernel send
+ * queue is congested, skips frames and gets the newest one when it catches up.
+ */
+class JPEGHTTPServer
+{
+public:
+  // sharePort binds with SO_REUSEPORT, see JPEGRTSPServer::createNew().
+  static std::unique_ptr<JPEGHTTPServer> createNew(UsageEnvironment& env,
+                                                   uint16_t          port,
+                                                   unsigned          framerate,
+                                                   bool              sharePort = false);
+  ~JPEGHTTPServer();
+
+  JPEGHTTPServer(const JPEGHTTPServer&)            = delete;
+  JPEGHTTPServer& operator=(const JPEGHTTPServer&) = delete;
+
+  void addStream(const std::string& name, std::shared_ptr<JPEGFrameStore> store);
+
+private:
+  struct Connection
+  {
+    JPEGHTTPServer* server;
+    int             fd;
+    std::string     request; // until the blank line ending the headers
+
+    std::shared_ptr<JPEGFrameStore> store;          // set for MJPEG connections
+    unsigned                        sentGeneration = 0;
+    unsigned                        partsSent      = 0;
+    bool                            closeWhenSent  = false;
+
+    // response or part being written; frame keeps the body's buffer alive
+    std::shared_ptr<const JPEGFrame> frame;
+    std::string                      head;
+    struct iovec                     iov[3];
+    unsigned                         iovCount = 0;
+    unsigned                         iovIndex = 0;
+  };
+
+  JPEGHTTPServer(UsageEnvironment& env, int socket, unsigned framerate);
+
+  // The crop store of region of source; nullptr if RTSP_MAX_REGION_STREAMS regions are all being served.
+  std::shared_ptr<JPEGFrameStore> regionStore(std::shared_ptr<JPEGFrameStore> source, const JpegCrop::Region& region);
+
+  void handleRequest(Connection* conn);
+  void respond(Connection* conn, const char* status, const char* extraHeaders);
+  void startWrite(Connection* conn, std::shared_ptr<const JPEGFrame> frame);
+  void continueWriting(Connection* conn);
+  void closeConnection(Connection* conn);
+  void scheduleTick();
+  void tick();
+
+  static void incomingConnection(void* clientData, int mask);
+  static void incomingData(void* clientData, int mask);
+  static void tick(void* clientData);
+
+private:
+  UsageEnvironment& m_env;
+  int               m_socket;
+  unsigned          m_framerate;
+  TaskToken         m_tickTask = nullptr;
+
+  std::map<std::string, std::shared_ptr<JPEGFrameStore>> m_streams;
+  std::string                                            m_defaultStream;
+  std::vector<std::shared_ptr<JPEGFrameStore>>           m_regionStores; // oldest first
+
+  std::map<int, std::unique_ptr<Connection>> m_connections;
+};
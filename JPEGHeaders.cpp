@@ -0,0 +1,164 @@
+#include "JPEGHeaders.h"
+#include "JPEGParser.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace JpegHeaders
+{
+
+  const uint8_t luma_quantizer[64] = {16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+                                      14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+                                      18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+                                      49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+
+  const uint8_t chroma_quantizer[64] = {17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+                                        24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+                                        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+                                        99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+
+  const uint8_t zigzag[64] = {0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+                              12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+                              35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+                              58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+  const uint8_t dc_luma_bits[16]   = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+  const uint8_t dc_chroma_bits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+  const uint8_t dc_vals[12]        = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+  const uint8_t ac_luma_bits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+  const uint8_t ac_luma_vals[162] = {
+      0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71,
+      0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+      0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37,
+      0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+      0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
+      0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+      0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+      0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+      0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+  const uint8_t ac_chroma_bits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+  const uint8_t ac_chroma_vals[162] = {
+      0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+      0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+      0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+      0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+      0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+      0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+      0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+      0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+      0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+  void make_tables(unsigned q, uint8_t lqt[64], uint8_t cqt[64])
+  {
+    q              = std::min(100u, std::max(1u, q));
+    unsigned scale = q < 50 ? 5000 / q : 200 - q * 2;
+
+    for (unsigned i = 0; i < 64; i++)
+    {
+      lqt[i] = std::min(255u, std::max(1u, (luma_quantizer[zigzag[i]] * scale + 50) / 100));
+      cqt[i] = std::min(255u, std::max(1u, (chroma_quantizer[zigzag[i]] * scale + 50) / 100));
+    }
+  }
+
+  static void put_marker(std::vector<uint8_t>& out, uint8_t marker, unsigned length)
+  {
+    out.push_back(JpegParser::JPEG_MARKER);
+    out.push_back(marker);
+    out.push_back(length >> 8);
+    out.push_back(length & 0xFF);
+  }
+
+  static void put_huffman_table(std::vector<uint8_t>& out, uint8_t id, const uint8_t bits[16], const uint8_t* vals)
+  {
+    unsigned count = 0;
+    out.push_back(id);
+    for (unsigned i = 0; i < 16; i++)
+    {
+      out.push_back(bits[i]);
+      count += bits[i];
+    }
+    out.insert(out.end(), vals, vals + count);
+  }
+
+  void make_headers(std::vector<uint8_t>& out,
+                    uint8_t               type,
+                    unsigned              width,
+                    unsigned              height,
+                    const uint8_t*        qtables,
+                    unsigned              precision,
+                    uint16_t              dri)
+  {
+    width <<= 3;
+    height <<= 3;
+
+    out.push_back(JpegParser::JPEG_MARKER);
+    out.push_back(JpegParser::JPEG_MARKER_SOI);
+
+    for (unsigned i = 0; i < 2; i++)
+    {
+      unsigned size = (precision & (1 << i)) ? 128 : 64;
+      put_marker(out, JpegParser::JPEG_MARKER_DQT, 3 + size);
+      out.push_back((size == 128 ? 0x10 : 0x00) | i);
+      out.insert(out.end(), qtables, qtables + size);
+      qtables += size;
+    }
+
+    if (dri != 0)
+    {
+      put_marker(out, JpegParser::JPEG_MARKER_DRI, 4);
+      out.push_back(dri >> 8);
+      out.push_back(dri & 0xFF);
+    }
+
+    put_marker(out, JpegParser::JPEG_MARKER_SOF, 17);
+    out.push_back(8);
+    out.push_back(height >> 8);
+    out.push_back(height & 0xFF);
+    out.push_back(width >> 8);
+    out.push_back(width & 0xFF);
+    out.push_back(3);
+    /* type 0 is 4:2:2, type 1 is 4:2:0 */
+    const uint8_t components[9] = {1, (uint8_t)(type == 0 ? 0x21 : 0x22), 0, 2, 0x11, 1, 3, 0x11, 1};
+    out.insert(out.end(), components, components + sizeof components);
+
+    put_marker(out, JpegParser::JPEG_MARKER_DHT, 2 + 4 * 17 + 12 + 12 + 162 + 162);
+    put_huffman_table(out, 0x00, dc_luma_bits, dc_vals);
+    put_huffman_table(out, 0x10, ac_luma_bits, ac_luma_vals);
+    put_huffman_table(out, 0x01, dc_chroma_bits, dc_vals);
+    put_huffman_table(out, 0x11, ac_chroma_bits, ac_chroma_vals);
+
+    put_marker(out, JpegParser::JPEG_MARKER_SOS, 12);
+    const uint8_t scan[10] = {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0};
+    out.insert(out.end(), scan, scan + sizeof scan);
+  }
+
+  HuffTable::HuffTable(const uint8_t bits[16], const uint8_t* vals)
+  {
+    memset(size, 0, sizeof size);
+
+    uint16_t c = 0;
+    unsigned k = 0;
+    for (unsigned len = 1; len <= 16; len++)
+    {
+      for (unsigned i = 0; i < bits[len - 1]; i++)
+      {
+        code[vals[k]] = c++;
+        size[vals[k]] = len;
+        k++;
+      }
+      c <<= 1;
+    }
+  }
+
+  unsigned magnitude_bits(int value)
+  {
+    unsigned bits = 0;
+    for (value = abs(value); value != 0; value >>= 1)
+      bits++;
+    return bits;
+  }
+
+} // namespace JpegHeaders
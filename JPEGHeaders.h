@@ -0,0 +1,105 @@
+#ifndef JPEGSTREAMER_JPEGHEADERS_H
+#define JPEGSTREAMER_JPEGHEADERS_H
+
+#include <cstdint>
+#include <vector>
+
+namespace JpegHeaders
+{
+
+  /*
+   * The ITU T.81 Annex K tables. RFC 2435 receivers assume these for every
+   * type 0/1 stream, so anything we encode or rebuild uses them too.
+   */
+  extern const uint8_t luma_quantizer[64];   /* natural order */
+  extern const uint8_t chroma_quantizer[64]; /* natural order */
+  extern const uint8_t zigzag[64];           /* natural index of each zigzag position */
+
+  extern const uint8_t dc_luma_bits[16];
+  extern const uint8_t dc_chroma_bits[16];
+  extern const uint8_t dc_vals[12];
+  extern const uint8_t ac_luma_bits[16];
+  extern const uint8_t ac_luma_vals[162];
+  extern const uint8_t ac_chroma_bits[16];
+  extern const uint8_t ac_chroma_vals[162];
+
+  /*
+   * make_tables:
+   * RFC 2435 Appendix A. Scales the standard tables for a Q factor of 1..99
+   * (100 gives all ones, as in libjpeg) into lqt and cqt, in zigzag order as
+   * they appear in DQT.
+   */
+  void make_tables(unsigned q, uint8_t lqt[64], uint8_t cqt[64]);
+
+  /*
+   * make_headers:
+   * RFC 2435 Appendix B. Appends SOI, DQT, SOF0, DHT, DRI (when dri is not 0)
+   * and SOS for an RTP/JPEG type 0 or 1 image to out. width and height are in
+   * 8 pixel units as carried in the RTP/JPEG header. qtables holds the luma
+   * then the chroma table, each 128 bytes if its bit is set in precision and
+   * 64 bytes otherwise.
+   */
+  void make_headers(std::vector<uint8_t>& out,
+                    uint8_t               type,
+                    unsigned              width,
+                    unsigned              height,
+                    const uint8_t*        qtables,
+                    unsigned              precision,
+                    uint16_t              dri);
+
+  /*
+   * HuffTable:
+   * Code and code length of every symbol of a Huffman table given as in DHT,
+   * for encoding.
+   */
+  struct HuffTable
+  {
+    uint16_t code[256];
+    uint8_t  size[256];
+
+    HuffTable(const uint8_t bits[16], const uint8_t* vals);
+  };
+
+  /*
+   * BitWriter:
+   * Appends entropy-coded data to out, most significant bit first, stuffing
+   * a zero byte after every 0xFF. put() takes at most 16 bits at a time.
+   */
+  class BitWriter
+  {
+  public:
+    explicit BitWriter(std::vector<uint8_t>& out) : m_out(out) {}
+
+    void put(uint32_t bits, unsigned count)
+    {
+      m_acc = (m_acc << count) | (bits & ((1u << count) - 1));
+      m_count += count;
+      while (m_count >= 8)
+      {
+        m_count -= 8;
+        uint8_t byte = (m_acc >> m_count) & 0xFF;
+        m_out.push_back(byte);
+        if (byte == 0xFF)
+          m_out.push_back(0x00); /* byte stuffing */
+      }
+    }
+
+    // pads the last byte with 1 bits, as required before a marker
+    void flush()
+    {
+      if (m_count > 0)
+        put(0x7F, 8 - m_count);
+    }
+
+  private:
+    std::vector<uint8_t>& m_out;
+    uint32_t              m_acc   = 0;
+    unsigned              m_count = 0;
+  };
+
+  /* magnitude category of a coefficient, i.e. the number of extra bits coding it */
+  unsigned magnitude_bits(int value);
+
+} // namespace JpegHeaders
+
+#endif // JPEGSTREAMER_JPEGHEADERS_H
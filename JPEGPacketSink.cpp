@@ -0,0 +1,322 @@
+#include "JPEGPacketSink.hh"
+#include "FrameTrace.h"
+#include "OverloadControl.hh"
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+// RFC 3551 static payload type for JPEG
+#define JPEG_RTP_PAYLOAD_TYPE 26
+
+unsigned JPEGPacketSource::maxPayload() const
+{
+  return m_sink != nullptr ? m_sink->maxPayload() : PACKET_SINK_DEFAULT_MAX_PAYLOAD;
+}
+
+JPEGPacketSink* JPEGPacketSink::createNew(UsageEnvironment& env, Groupsock* RTPgs, JPEGPacketSource* source)
+{
+  return new JPEGPacketSink(env, RTPgs, source);
+}
+
+JPEGPacketSink::JPEGPacketSink(UsageEnvironment& env, Groupsock* RTPgs, JPEGPacketSource* source)
+    : VideoRTPSink(env, RTPgs, JPEG_RTP_PAYLOAD_TYPE, 90000, "JPEG"), m_source(source)
+{
+  m_source->setSink(this);
+}
+
+JPEGPacketSink::~JPEGPacketSink()
+{
+  stopInterleaved();
+  if (m_writableWatch >= 0)
+    ::close(m_writableWatch);
+}
+
+void JPEGPacketSink::setInterleaved(int socketNum, unsigned char channelId)
+{
+  stopInterleaved();
+  m_tcpSocket  = socketNum;
+  m_tcpChannel = channelId;
+}
+
+void JPEGPacketSink::stopInterleaved()
+{
+  if (m_waiting)
+  {
+    envir().taskScheduler().turnOffBackgroundReadHandling(m_writableWatch);
+    epoll_ctl(m_writableWatch, EPOLL_CTL_DEL, m_tcpSocket, nullptr);
+    m_waiting = false;
+  }
+
+  m_tcpQueue.clear();
+  m_tcpSocket = -1;
+}
+
+void JPEGPacketSink::sendFrame(std::shared_ptr<const JPEGFrame>         frame,
+                               std::shared_ptr<const JPEGPacketization> packets,
+                               struct timeval                           presentationTime)
+{
+  if (m_tcpSocket < 0 || packets->packets.empty())
+    return;
+
+  /* a frame none of which went out yet is stale now, the client skips it */
+  if (!m_tcpQueue.empty() && m_tcpQueue.back().nextPacket == 0)
+  {
+    TRACE_INSTANT("interleaved_skip", m_tcpQueue.back().frame->traceId);
+    m_tcpQueue.pop_back();
+  }
+
+  QueuedFrame queued;
+  queued.frame            = std::move(frame);
+  queued.packets          = std::move(packets);
+  queued.presentationTime = presentationTime;
+  queued.rtpTimestamp     = convertToRTPTimestamp(presentationTime);
+  queued.headers.resize(queued.packets->packets.size() * 16);
+  m_tcpQueue.push_back(std::move(queued));
+
+  if (!m_waiting)
+    flush(false);
+}
+
+void JPEGPacketSink::flush(bool writable)
+{
+  struct iovec iov[INTERLEAVED_MAX_IOV];
+
+  while (!m_tcpQueue.empty())
+  {
+    QueuedFrame& queued = m_tcpQueue.front();
+    const auto&  list   = queued.packets->packets;
+
+    /* gather as many whole packets as the socket has room for; once the kernel said
+     * the socket is writable, one packet goes whatever the room, so that waiting ends */
+    unsigned space    = sendQueueSpace(m_tcpSocket);
+    unsigned iovCount = 0;
+    unsigned first    = queued.nextPacket;
+    unsigned next     = first;
+    size_t   total    = 0;
+    while (next < list.size() && iovCount + 3 <= INTERLEAVED_MAX_IOV)
+    {
+      const JPEGPacketization::Packet& packet = list[next];
+
+      size_t size = 16 + packet.headerSize + packet.scanSize;
+      if (total + size > space && !(next == first && writable))
+        break;
+
+      /* '$' framing (RFC 2326 10.12), then the RTP header */
+      uint8_t* header = queued.headers.data() + next * 16;
+      uint16_t length = 12 + packet.headerSize + packet.scanSize;
+      uint16_t seqNo  = fSeqNo + (next - first);
+      uint32_t ssrc   = SSRC();
+      header[0]       = '$';
+      header[1]       = m_tcpChannel;
+      header[2]       = length >> 8;
+      header[3]       = length;
+      header[4]       = 0x80;
+      header[5]       = rtpPayloadType() | (next + 1 == list.size() ? 0x80 : 0);
+      header[6]       = seqNo >> 8;
+      header[7]       = seqNo;
+      header[8]       = queued.rtpTimestamp >> 24;
+      header[9]       = queued.rtpTimestamp >> 16;
+      header[10]      = queued.rtpTimestamp >> 8;
+      header[11]      = queued.rtpTimestamp;
+      header[12]      = ssrc >> 24;
+      header[13]      = ssrc >> 16;
+      header[14]      = ssrc >> 8;
+      header[15]      = ssrc;
+
+      iov[iovCount++] = {header, 16};
+      iov[iovCount++] = {(void*)(queued.packets->headers.data() + packet.header), packet.headerSize};
+      iov[iovCount++] = {(void*)(queued.frame->payload.payload + packet.scanOffset), packet.scanSize};
+
+      total += size;
+      next++;
+    }
+
+    if (next == first)
+    {
+      waitWritable();
+      return;
+    }
+
+    struct msghdr message = {};
+    message.msg_iov       = iov;
+    message.msg_iovlen    = iovCount;
+    ssize_t written       = sendmsg(m_tcpSocket, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+      waitWritable();
+      return;
+    }
+    if (written < 0)
+    {
+      /* the connection is gone; live555 notices it too and tears the session down */
+      envir() << "JPEGPacketSink: interleaved write failed: " << strerror(errno) << "\n";
+      stopInterleaved();
+      return;
+    }
+
+    /* count the packets that are out whole, and how much of the next one is */
+    size_t   done     = written;
+    unsigned finished = first;
+    unsigned payload  = 0;
+    while (finished < next)
+    {
+      const JPEGPacketization::Packet& packet = list[finished];
+
+      size_t size = 16 + packet.headerSize + packet.scanSize;
+      if (done < size)
+        break;
+      done -= size;
+      payload += packet.headerSize + packet.scanSize;
+      finished++;
+    }
+    writable = false;
+
+    /* the kernel took part of a packet: finish it before returning to the event loop,
+     * live555 writes RTCP and RTSP replies to this socket too and they must not land inside it */
+    if (finished < next && done > 0)
+    {
+      const JPEGPacketization::Packet& packet = list[finished];
+      if (!finishPacket(iov + (finished - first) * 3, done))
+      {
+        /* its framing is broken, have live555 see the connection fail and tear the session down */
+        envir() << "JPEGPacketSink: interleaved connection stalled inside a packet\n";
+        shutdown(m_tcpSocket, SHUT_RDWR);
+        stopInterleaved();
+        return;
+      }
+      payload += packet.headerSize + packet.scanSize;
+      finished++;
+    }
+
+    if (finished > first)
+    {
+      TRACE_INSTANT("interleaved_write", queued.frame->traceId);
+
+      if (first == 0)
+      {
+        fCurrentTimestamp           = queued.rtpTimestamp;
+        fMostRecentPresentationTime = queued.presentationTime;
+        if (fInitialPresentationTime.tv_sec == 0 && fInitialPresentationTime.tv_usec == 0)
+          fInitialPresentationTime = queued.presentationTime;
+      }
+      fSeqNo += finished - first;
+      fPacketCount += finished - first;
+      fOctetCount += payload;
+      fTotalOctetCount += payload;
+    }
+
+    queued.nextPacket = finished;
+    if (finished == list.size())
+      m_tcpQueue.pop_front();
+
+    /* the kernel took only part of the batch, the socket is full */
+    if (finished < next)
+    {
+      waitWritable();
+      return;
+    }
+  }
+}
+
+bool JPEGPacketSink::finishPacket(struct iovec* iov, size_t written)
+{
+  /* like live555's own TCP path, wait for the rest of the packet rather than break the
+   * framing; only ever the rest of one packet, which has rarely not fitted */
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(INTERLEAVED_FINISH_PACKET_MS);
+  for (unsigned i = 0; i < 3; i++)
+  {
+    if (written >= iov[i].iov_len)
+    {
+      written -= iov[i].iov_len;
+      continue;
+    }
+
+    const uint8_t* data = (const uint8_t*)iov[i].iov_base + written;
+    size_t         left = iov[i].iov_len - written;
+    written             = 0;
+    while (left > 0)
+    {
+      ssize_t sent = send(m_tcpSocket, data, left, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (sent > 0)
+      {
+        data += sent;
+        left -= sent;
+        continue;
+      }
+      if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return false;
+
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      if (wait.count() <= 0)
+        return false;
+      struct pollfd pfd = {m_tcpSocket, POLLOUT, 0};
+      poll(&pfd, 1, (int)wait.count());
+    }
+  }
+  return true;
+}
+
+void JPEGPacketSink::waitWritable()
+{
+  if (m_writableWatch < 0)
+    m_writableWatch = epoll_create1(EPOLL_CLOEXEC);
+
+  struct epoll_event event = {};
+  event.events             = EPOLLOUT;
+  if (m_writableWatch < 0 || epoll_ctl(m_writableWatch, EPOLL_CTL_ADD, m_tcpSocket, &event) != 0)
+  {
+    envir() << "JPEGPacketSink: cannot wait for the interleaved connection: " << strerror(errno) << "\n";
+    stopInterleaved();
+    return;
+  }
+
+  envir().taskScheduler().turnOnBackgroundReadHandling(m_writableWatch, onWritable, this);
+  m_waiting = true;
+}
+
+void JPEGPacketSink::onWritable(void* clientData, int /*mask*/)
+{
+  JPEGPacketSink* sink = (JPEGPacketSink*)clientData;
+
+  sink->envir().taskScheduler().turnOffBackgroundReadHandling(sink->m_writableWatch);
+  epoll_ctl(sink->m_writableWatch, EPOLL_CTL_DEL, sink->m_tcpSocket, nullptr);
+  sink->m_waiting = false;
+
+  sink->flush(true);
+}
+
+void JPEGPacketSink::doSpecialFrameHandling(unsigned /*fragmentationOffset*/,
+                                            unsigned char* /*frameStart*/,
+                                            unsigned /*numBytesInFrame*/,
+                                            struct timeval framePresentationTime,
+                                            unsigned /*numRemainingBytes*/)
+{
+  TRACE_INSTANT("packet", m_source->traceId());
+
+  /* the payload already carries its RTP/JPEG header, only the RTP header is ours */
+  if (m_source->markerBit())
+    setMarkerBit();
+  setTimestamp(framePresentationTime);
+}
+
+Boolean JPEGPacketSink::frameCanAppearAfterPacketStart(unsigned char const* /*frameStart*/,
+                                                       unsigned /*numBytesInFrame*/) const
+{
+  return False;
+}
+
+void JPEGPacketSink::stopPlaying()
+{
+  /* the frame being written is finished, or the connection's framing breaks */
+  bool started = !m_tcpQueue.empty() && m_tcpQueue.front().nextPacket > 0;
+  m_tcpQueue.resize(started ? 1 : 0);
+
+  VideoRTPSink::stopPlaying();
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "JPEGFrameStore.hh"
+
+#include <FramedSource.hh>
+#include <VideoRTPSink.hh>
+
+#include <sys/uio.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+// RTP payload used until a source knows its sink: live555's default packet size less the RTP header.
+#define PACKET_SINK_DEFAULT_MAX_PAYLOAD (1456 - 12)
+
+// Gather entries per write on an interleaved connection, three per packet.
+#define INTERLEAVED_MAX_IOV 1023
+
+// How long the rest of a packet the kernel took only part of may take before the connection is given up.
+#define INTERLEAVED_FINISH_PACKET_MS 500
+
+class JPEGPacketSink;
+
+/*
+ * JPEGPacketSource:
+ *
+ * Source that delivers complete RTP/JPEG payloads (RFC 2435), header
+ * included, one per delivery, for JPEGPacketSink.
+ */
+class JPEGPacketSource : public FramedSource
+{
+public:
+  // The sink the payloads go to; its packet size bounds the payloads and its
+  // send queue decides whether a frame is skipped under overload.
+  void setSink(JPEGPacketSink* sink)
+  {
+    m_sink = sink;
+  }
+
+  // Marker bit of the payload last delivered.
+  bool markerBit() const
+  {
+    return m_marker;
+  }
+
+  // FrameTrace id of the frame the payload last delivered belongs to.
+  uint32_t traceId() const
+  {
+    return m_traceId;
+  }
+
+protected:
+  explicit JPEGPacketSource(UsageEnvironment& env) : FramedSource(env) {}
+
+  // Largest payload that fits one of the sink's packets.
+  unsigned maxPayload() const;
+
+protected:
+  JPEGPacketSink* m_sink    = nullptr;
+  bool            m_marker  = false;
+  uint32_t        m_traceId = 0;
+};
+
+/*
+ * JPEGPacketSink:
+ *
+ * Sends every payload of a JPEGPacketSource in a packet of its own. The
+ * payloads carry their RTP/JPEG headers already, so all that is done per
+ * client is the RTP header: sequence number, timestamp, SSRC and marker.
+ *
+ * For RTP-over-RTSP clients live555 would write each packet, with its own
+ * system call, to the RTSP connection and block the event loop whenever the
+ * kernel takes only part of one. Once setInterleaved() is called, whole frames
+ * are handed to sendFrame() instead and queued here. Their packets are written
+ * straight from the frame's cached packetization, as many per system call as the
+ * socket has room for. When it has none the sink waits for it to become
+ * writable instead of blocking. live555 writes RTCP and RTSP replies to the
+ * same socket, so control only goes back to the event loop between whole
+ * packets: should the kernel take only part of one, which the room check makes
+ * rare, its rest is written before flush() returns. A client that falls behind
+ * skips frames that have not started yet but finishes the one it is in, so
+ * what it gets stays decodable.
+ */
+class JPEGPacketSink : public VideoRTPSink
+{
+public:
+  static JPEGPacketSink* createNew(UsageEnvironment& env, Groupsock* RTPgs, JPEGPacketSource* source);
+
+  unsigned maxPayload() const
+  {
+    return ourMaxPacketSize() - 12;
+  }
+
+  // The client receives RTP interleaved on its RTSP connection (RFC 2326 10.12).
+  void setInterleaved(int socketNum, unsigned char channelId);
+
+  // Stops writing to the RTSP connection; must be called before live555 closes it.
+  void stopInterleaved();
+
+  bool interleaved() const
+  {
+    return m_tcpSocket >= 0;
+  }
+
+  // Interleaved clients only: queues a frame, replacing one that has not started yet, and writes what fits.
+  void sendFrame(std::shared_ptr<const JPEGFrame>         frame,
+                 std::shared_ptr<const JPEGPacketization> packets,
+                 struct timeval                           presentationTime);
+
+protected:
+  JPEGPacketSink(UsageEnvironment& env, Groupsock* RTPgs, JPEGPacketSource* source);
+  // called only by createNew()
+  virtual ~JPEGPacketSink();
+
+private:
+  // redefined virtual functions:
+  virtual void    doSpecialFrameHandling(unsigned       fragmentationOffset,
+                                         unsigned char* frameStart,
+                                         unsigned       numBytesInFrame,
+                                         struct timeval framePresentationTime,
+                                         unsigned       numRemainingBytes) override;
+  virtual Boolean frameCanAppearAfterPacketStart(unsigned char const* frameStart,
+                                                 unsigned             numBytesInFrame) const override;
+  virtual void    stopPlaying() override;
+
+  // Writes what the socket takes; after a wakeup at least the next packet, however full the send queue looks.
+  void        flush(bool writable);
+  bool        finishPacket(struct iovec* iov, size_t written);
+  void        waitWritable();
+  static void onWritable(void* clientData, int mask);
+
+private:
+  struct QueuedFrame
+  {
+    std::shared_ptr<const JPEGFrame>         frame;
+    std::shared_ptr<const JPEGPacketization> packets;
+    std::vector<uint8_t>                     headers; // '$' framing and RTP header of each packet
+    struct timeval                           presentationTime;
+    uint32_t                                 rtpTimestamp;
+    unsigned                                 nextPacket = 0;
+  };
+
+  JPEGPacketSource* m_source;
+
+  int                     m_tcpSocket  = -1; // live555's RTSP connection, never closed here
+  unsigned char           m_tcpChannel = 0;
+  std::deque<QueuedFrame> m_tcpQueue;
+
+  // An epoll instance watching m_tcpSocket for room; live555 has the socket's
+  // own scheduler handler, and the scheduler keeps one per descriptor.
+  int  m_writableWatch = -1;
+  bool m_waiting       = false;
+};
@@ -320,6 +320,66 @@ JpegParser::RtpJPEGPayload JpegParser::print_error(const char* error)
   return RtpJPEGPayload();
 }
 
+uint32_t JpegParser::header_size(const uint8_t* buffer, uint32_t total_size)
+{
+  uint32_t offset = 0;
+
+  if (total_size < 2 || buffer[0] != JPEG_MARKER || buffer[1] != JPEG_MARKER_SOI)
+    return 0;
+  offset = 2;
+
+  while (offset + 1 < total_size)
+  {
+    uint8_t marker;
+
+    if (buffer[offset] != JPEG_MARKER)
+    {
+      /* garbage between segments, scan_marker would skip it too */
+      ++offset;
+      continue;
+    }
+
+    marker = buffer[offset + 1];
+    if (marker == JPEG_MARKER)
+    {
+      /* fill byte */
+      ++offset;
+      continue;
+    }
+    offset += 2;
+
+    /* standalone markers carry no length */
+    if (marker == JPEG_MARKER_SOI || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+      continue;
+
+    if (offset + 2 > total_size)
+      return 0;
+
+    uint32_t length = read_uint16_t(buffer, total_size, offset);
+    if (length < 2)
+      return 0;
+    offset += length - 2;
+
+    if (marker == JPEG_MARKER_SOS)
+      return offset <= total_size ? offset : 0;
+  }
+
+  return 0;
+}
+
+uint64_t JpegParser::fingerprint(const uint8_t* buffer, uint32_t total_size)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (uint32_t i = 0; i < total_size; i++)
+  {
+    hash ^= buffer[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
 JpegParser::RtpJPEGPayload JpegParser::handle_buffer(uint8_t*              buffer,
                                                      uint32_t              total_size,
                                                      uint64_t              timestamp,
@@ -426,7 +486,10 @@ JpegParser::RtpJPEGPayload JpegParser::handle_buffer(uint8_t*              buffe
   offset = 0;
 
   if (dri_found)
+  {
     pay.type += 64;
+    pay.restart_interval = restart_marker_header.restart_interval;
+  }
 
   quant_data_size = 0;
 
@@ -95,6 +95,8 @@ namespace JpegParser
       payload   = nullptr;
       size      = 0;
       timestamp = 0;
+
+      restart_interval = 0;
     }
 
     uint8_t* payload;
@@ -109,6 +111,8 @@ namespace JpegParser
 
     uint32_t size;
     uint64_t timestamp;
+
+    uint16_t restart_interval;
   };
 
   uint8_t read_uint8_t(const uint8_t* buffer, uint32_t total_size, uint32_t& offset);
@@ -131,6 +135,20 @@ namespace JpegParser
 
   RtpJPEGPayload print_error(const char* error);
 
+  /*
+   * header_size:
+   * Walks the marker segments of a possibly incomplete JPEG starting at SOI and
+   * returns the offset of the first entropy-coded byte once the whole SOS header
+   * is in the buffer, or 0 if more data is needed.
+   */
+  uint32_t header_size(const uint8_t* buffer, uint32_t total_size);
+
+  /*
+   * fingerprint:
+   * 64 bit FNV-1a hash of a frame, used to detect frames whose content did not change.
+   */
+  uint64_t fingerprint(const uint8_t* buffer, uint32_t total_size);
+
   RtpJPEGPayload handle_buffer(uint8_t*              buffer,
                                uint32_t              total_size,
                                uint64_t              timestamp,
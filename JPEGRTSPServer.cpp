@@ -0,0 +1,262 @@
+#include "JPEGRTSPServer.hh"
+#include "JPEGUnicastSubsession.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// As setUpOurSocket(), but with SO_REUSEPORT so that several processes can accept on the port.
+static int setUpSharedSocket(UsageEnvironment& env, Port ourPort, int family)
+{
+  int sock = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+  {
+    env.setResultErrMsg("unable to create stream socket: ");
+    return -1;
+  }
+
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one);
+
+  struct sockaddr_storage addr = {};
+  socklen_t               addrLen;
+  if (family == AF_INET6)
+  {
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof one);
+    auto* addr6        = (struct sockaddr_in6*)&addr;
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_addr   = in6addr_any;
+    addr6->sin6_port   = ourPort.num();
+    addrLen            = sizeof *addr6;
+  }
+  else
+  {
+    auto* addr4            = (struct sockaddr_in*)&addr;
+    addr4->sin_family      = AF_INET;
+    addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+    addr4->sin_port        = ourPort.num();
+    addrLen                = sizeof *addr4;
+  }
+
+  if (bind(sock, (struct sockaddr*)&addr, addrLen) != 0 || listen(sock, SOMAXCONN) != 0)
+  {
+    env.setResultErrMsg("unable to listen on shared port: ");
+    ::close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+JPEGRTSPServer* JPEGRTSPServer::createNew(UsageEnvironment& env,
+                                          Port              ourPort,
+                                          unsigned          maxSessions,
+                                          unsigned          maxSessionsPerStream,
+                                          bool              sharePort)
+{
+  int ourSocketIPv4 = sharePort ? setUpSharedSocket(env, ourPort, AF_INET) : setUpOurSocket(env, ourPort, AF_INET);
+  int ourSocketIPv6 = sharePort ? setUpSharedSocket(env, ourPort, AF_INET6) : setUpOurSocket(env, ourPort, AF_INET6);
+  if (ourSocketIPv4 < 0 && ourSocketIPv6 < 0)
+    return nullptr;
+
+  return new JPEGRTSPServer(env, ourSocketIPv4, ourSocketIPv6, ourPort, maxSessions, maxSessionsPerStream, sharePort);
+}
+
+JPEGRTSPServer::JPEGRTSPServer(UsageEnvironment& env,
+                               int               ourSocketIPv4,
+                               int               ourSocketIPv6,
+                               Port              ourPort,
+                               unsigned          maxSessions,
+                               unsigned          maxSessionsPerStream,
+                               bool              sharedPort)
+    : RTSPServer(env, ourSocketIPv4, ourSocketIPv6, ourPort, nullptr, 65),
+      m_maxSessions(maxSessions),
+      m_maxSessionsPerStream(maxSessionsPerStream),
+      m_sharedPort(sharedPort)
+{}
+
+JPEGRTSPServer::~JPEGRTSPServer() = default;
+
+GenericMediaServer::ClientConnection* JPEGRTSPServer::createNewClientConnection(int                            clientSocket,
+                                                                                struct sockaddr_storage const& clientAddr)
+{
+  return new JPEGRTSPClientConnection(*this, clientSocket, clientAddr);
+}
+
+GenericMediaServer::ClientSession* JPEGRTSPServer::createNewClientSession(u_int32_t sessionId)
+{
+  return new JPEGRTSPClientSession(*this, sessionId);
+}
+
+void JPEGRTSPServer::lookupServerMediaSession(char const*                             streamName,
+                                              lookupServerMediaSessionCompletionFunc* completionFunc,
+                                              void*                                   completionClientData,
+                                              Boolean /*isFirstLookupInSession*/)
+{
+  ServerMediaSession* sms = findStream(streamName);
+  if (completionFunc != nullptr)
+    completionFunc(completionClientData, sms);
+}
+
+ServerMediaSession* JPEGRTSPServer::findStream(const std::string& streamName)
+{
+  ServerMediaSession* sms = getServerMediaSession(streamName.c_str());
+  return sms != nullptr ? sms : createRegionStream(streamName);
+}
+
+ServerMediaSession* JPEGRTSPServer::createRegionStream(const std::string& streamName)
+{
+  size_t query = streamName.find("?roi=");
+  if (query == std::string::npos)
+    return nullptr;
+
+  JpegCrop::Region region;
+  if (!JpegCrop::parse_region(streamName.c_str() + query + 5, region))
+    return nullptr;
+
+  ServerMediaSession* source = getServerMediaSession(streamName.substr(0, query).c_str());
+  if (source == nullptr)
+    return nullptr;
+
+  /* "JPEG?roi=0,0,64,64" and "JPEG?roi=00,0,64,64" are the same stream */
+  std::string name = streamName.substr(0, query) + "?roi=" + JpegCrop::region_name(region);
+  if (ServerMediaSession* sms = getServerMediaSession(name.c_str()))
+    return sms;
+
+  if (m_regionStreams.size() >= RTSP_MAX_REGION_STREAMS)
+  {
+    auto unused = std::find_if(m_regionStreams.begin(),
+                               m_regionStreams.end(),
+                               [this](const std::string& regionStream)
+                               {
+                                 ServerMediaSession* sms = getServerMediaSession(regionStream.c_str());
+                                 return sms == nullptr || sms->referenceCount() == 0;
+                               });
+    if (unused == m_regionStreams.end())
+      return nullptr;
+
+    if (ServerMediaSession* sms = getServerMediaSession(unused->c_str()))
+      removeServerMediaSession(sms);
+    m_regionStreams.erase(unused);
+  }
+
+  /* every stream has the one subsession made in main() */
+  ServerMediaSubsessionIterator iter(*source);
+  auto* subsession = (JPEGServerMediaSubsession*)iter.next();
+  if (subsession == nullptr)
+    return nullptr;
+
+  JPEGServerMediaSubsession* regionSubsession = subsession->createRegion(region);
+  if (regionSubsession == nullptr)
+    return nullptr;
+
+  ServerMediaSession* sms = ServerMediaSession::createNew(envir(), name.c_str(), name.c_str(), "JPEG region", False);
+  sms->addSubsession(regionSubsession);
+  addServerMediaSession(sms);
+  m_regionStreams.push_back(name);
+  return sms;
+}
+
+bool JPEGRTSPServer::admit(const std::string& streamName)
+{
+  auto     it             = m_streamSessions.find(streamName);
+  unsigned streamSessions = it != m_streamSessions.end() ? it->second : 0;
+
+  if (m_maxSessions != 0 && m_activeSessions >= m_maxSessions)
+    return false;
+  if (m_maxSessionsPerStream != 0 && streamSessions >= m_maxSessionsPerStream)
+    return false;
+
+  m_activeSessions++;
+  m_streamSessions[streamName]++;
+  return true;
+}
+
+void JPEGRTSPServer::release(const std::string& streamName)
+{
+  auto it = m_streamSessions.find(streamName);
+  if (it == m_streamSessions.end() || it->second == 0)
+    return;
+
+  /* region streams come and go, do not keep a count for every one ever played */
+  if (--it->second == 0)
+    m_streamSessions.erase(it);
+  m_activeSessions--;
+}
+
+// JPEGRTSPClientConnection
+
+JPEGRTSPServer::JPEGRTSPClientConnection::JPEGRTSPClientConnection(JPEGRTSPServer&                ourServer,
+                                                                   int                            clientSocket,
+                                                                   struct sockaddr_storage const& clientAddr)
+    : RTSPClientConnection(ourServer, clientSocket, clientAddr), m_server(ourServer)
+{}
+
+void JPEGRTSPServer::JPEGRTSPClientConnection::respondNotEnoughBandwidth()
+{
+  setRTSPResponse("453 Not Enough Bandwidth");
+}
+
+void JPEGRTSPServer::JPEGRTSPClientConnection::handleHTTPCmd_TunnelingGET(char const* sessionCookie)
+{
+  if (m_server.m_sharedPort)
+  {
+    handleHTTPCmd_notSupported();
+    return;
+  }
+  RTSPClientConnection::handleHTTPCmd_TunnelingGET(sessionCookie);
+}
+
+Boolean JPEGRTSPServer::JPEGRTSPClientConnection::handleHTTPCmd_TunnelingPOST(char const*          sessionCookie,
+                                                                             unsigned char const* extraData,
+                                                                             unsigned             extraDataSize)
+{
+  if (m_server.m_sharedPort)
+  {
+    handleHTTPCmd_notSupported();
+    return False;
+  }
+  return RTSPClientConnection::handleHTTPCmd_TunnelingPOST(sessionCookie, extraData, extraDataSize);
+}
+
+// JPEGRTSPClientSession
+
+JPEGRTSPServer::JPEGRTSPClientSession::JPEGRTSPClientSession(JPEGRTSPServer& ourServer, u_int32_t sessionId)
+    : RTSPClientSession(ourServer, sessionId), m_server(ourServer)
+{}
+
+JPEGRTSPServer::JPEGRTSPClientSession::~JPEGRTSPClientSession()
+{
+  if (!m_streamName.empty())
+    m_server.release(m_streamName);
+}
+
+void JPEGRTSPServer::JPEGRTSPClientSession::handleCmd_SETUP(RTSPClientConnection* ourClientConnection,
+                                                            char const*           urlPreSuffix,
+                                                            char const*           urlSuffix,
+                                                            char const*           fullRequestStr)
+{
+  if (m_streamName.empty())
+  {
+    /* "rtsp://host/<stream>/<track>" or, for aggregate control, "rtsp://host/<stream>" */
+    ServerMediaSession* sms = urlPreSuffix[0] != '\0' ? m_server.findStream(urlPreSuffix) : nullptr;
+    if (sms == nullptr)
+      sms = m_server.findStream(urlSuffix);
+
+    /* a stream that does not exist takes no slot, the base class answers 404 */
+    if (sms != nullptr)
+    {
+      std::string streamName = sms->streamName();
+      if (!m_server.admit(streamName))
+      {
+        ((JPEGRTSPClientConnection*)ourClientConnection)->respondNotEnoughBandwidth();
+        return;
+      }
+      m_streamName = streamName;
+    }
+  }
+
+  RTSPClientSession::handleCmd_SETUP(ourClientConnection, urlPreSuffix, urlSuffix, fullRequestStr);
+}
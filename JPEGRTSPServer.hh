@@ -0,0 +1,119 @@
+#pragma once
+
+#include <RTSPServer.hh>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Region streams ("<stream>?roi=x,y,w,h") kept at once; beyond it, one nobody plays is dropped to make room.
+#define RTSP_MAX_REGION_STREAMS 16
+
+/*
+ * JPEGRTSPServer:
+ *
+ * RTSPServer with admission control. A client session is counted against
+ * its stream on its first SETUP of an existing stream and released when the
+ * session goes away;
+ * SETUPs beyond the per-stream or global limit are answered with
+ * "453 Not Enough Bandwidth" so the clients already admitted keep their
+ * share of the server.
+ *
+ * "<stream>?roi=x,y,w,h" names a crop of a stream; its ServerMediaSession is
+ * made on first lookup, see JPEGServerMediaSubsession::createRegion().
+ *
+ * With a shared port each worker process of a multi-process server runs its
+ * own JPEGRTSPServer, and the kernel picks the worker for every connection.
+ * Sessions are not shared between workers, so a session has to stay on the
+ * connection that set it up: a PLAY or TEARDOWN sent on a new connection may
+ * reach another worker and get "454 Session Not Found". RTSP-over-HTTP
+ * tunnelling, which pairs a GET and a POST connection, is refused there.
+ */
+class JPEGRTSPServer : public RTSPServer
+{
+public:
+  // A limit of 0 means unlimited. With sharePort set the port is bound with SO_REUSEPORT,
+  // so that the worker processes of a multi-process server all accept on it; see above.
+  static JPEGRTSPServer* createNew(UsageEnvironment& env,
+                                   Port              ourPort,
+                                   unsigned          maxSessions,
+                                   unsigned          maxSessionsPerStream,
+                                   bool              sharePort = false);
+
+  unsigned activeSessions() const
+  {
+    return m_activeSessions;
+  }
+
+protected:
+  JPEGRTSPServer(UsageEnvironment& env,
+                 int               ourSocketIPv4,
+                 int               ourSocketIPv6,
+                 Port              ourPort,
+                 unsigned          maxSessions,
+                 unsigned          maxSessionsPerStream,
+                 bool              sharedPort);
+  // called only by createNew()
+  virtual ~JPEGRTSPServer();
+
+public:
+  class JPEGRTSPClientConnection : public RTSPServer::RTSPClientConnection
+  {
+  public:
+    JPEGRTSPClientConnection(JPEGRTSPServer& ourServer, int clientSocket, struct sockaddr_storage const& clientAddr);
+
+    void respondNotEnoughBandwidth();
+
+  protected:
+    // Refused on a shared port: the GET and POST connections may land on different workers.
+    virtual void    handleHTTPCmd_TunnelingGET(char const* sessionCookie) override;
+    virtual Boolean handleHTTPCmd_TunnelingPOST(char const*          sessionCookie,
+                                                unsigned char const* extraData,
+                                                unsigned             extraDataSize) override;
+
+  private:
+    JPEGRTSPServer& m_server;
+  };
+
+  class JPEGRTSPClientSession : public RTSPServer::RTSPClientSession
+  {
+  public:
+    JPEGRTSPClientSession(JPEGRTSPServer& ourServer, u_int32_t sessionId);
+    virtual ~JPEGRTSPClientSession();
+
+  protected:
+    virtual void handleCmd_SETUP(RTSPClientConnection* ourClientConnection,
+                                 char const*           urlPreSuffix,
+                                 char const*           urlSuffix,
+                                 char const*           fullRequestStr) override;
+
+  private:
+    JPEGRTSPServer& m_server;
+    std::string     m_streamName; // ServerMediaSession's name, set once admitted
+  };
+
+protected: // redefined virtual functions
+  virtual ClientConnection* createNewClientConnection(int clientSocket, struct sockaddr_storage const& clientAddr) override;
+  virtual ClientSession*    createNewClientSession(u_int32_t sessionId) override;
+  virtual void              lookupServerMediaSession(char const*                             streamName,
+                                                     lookupServerMediaSessionCompletionFunc* completionFunc,
+                                                     void*                                   completionClientData,
+                                                     Boolean isFirstLookupInSession) override;
+
+private:
+  bool admit(const std::string& streamName);
+  void release(const std::string& streamName);
+
+  // The stream named streamName, a region stream made on first use included; nullptr if there is none.
+  ServerMediaSession* findStream(const std::string& streamName);
+  ServerMediaSession* createRegionStream(const std::string& streamName);
+
+private:
+  unsigned m_maxSessions;
+  unsigned m_maxSessionsPerStream;
+  bool     m_sharedPort;
+
+  unsigned                        m_activeSessions = 0;
+  std::map<std::string, unsigned> m_streamSessions;
+  std::vector<std::string>        m_regionStreams; // oldest first
+};
@@ -0,0 +1,453 @@
+#include "JPEGRelay.hh"
+#include "FrameTrace.h"
+#include "JPEGHeaders.h"
+#include "JPEGParser.h"
+
+#include <liveMedia.hh>
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+
+  class RelayMediaSubsession : public MediaSubsession
+  {
+  public:
+    explicit RelayMediaSubsession(MediaSession& parent) : MediaSubsession(parent) {}
+
+  protected:
+    // Hand out each packet on its own, RTP/JPEG header included, instead of the
+    // frames JPEGVideoRTPSource would reassemble.
+    virtual Boolean createSourceObjects(int useSpecialRTPoffset) override
+    {
+      if (strcmp(fCodecName, "JPEG") != 0)
+        return MediaSubsession::createSourceObjects(useSpecialRTPoffset);
+
+      fReadSource = fRTPSource = SimpleRTPSource::createNew(
+          env(), fRTPSocket, fRTPPayloadFormat, fRTPTimestampFrequency, "video/JPEG", 0, False);
+      return fRTPSource != nullptr;
+    }
+  };
+
+  class RelayMediaSession : public MediaSession
+  {
+  public:
+    static RelayMediaSession* createNew(UsageEnvironment& env, char const* sdpDescription)
+    {
+      auto* session = new RelayMediaSession(env);
+      if (!session->initializeWithSDP(sdpDescription))
+      {
+        Medium::close(session);
+        return nullptr;
+      }
+      return session;
+    }
+
+  protected:
+    explicit RelayMediaSession(UsageEnvironment& env) : MediaSession(env) {}
+
+    virtual MediaSubsession* createNewMediaSubsession() override
+    {
+      return new RelayMediaSubsession(*this);
+    }
+  };
+
+  class RelayRTSPClient : public RTSPClient
+  {
+  public:
+    static RelayRTSPClient* createNew(UsageEnvironment& env, char const* url, JPEGRelay* relay)
+    {
+      return new RelayRTSPClient(env, url, relay);
+    }
+
+    JPEGRelay* relay;
+
+  protected:
+    RelayRTSPClient(UsageEnvironment& env, char const* url, JPEGRelay* relay)
+        : RTSPClient(env, url, 0, "JpegStreamer", 0, -1), relay(relay)
+    {}
+  };
+
+} // namespace
+
+std::unique_ptr<JPEGRelay> JPEGRelay::createNew(UsageEnvironment&               env,
+                                                const char*                     url,
+                                                std::shared_ptr<JPEGFrameStore> store)
+{
+  if (url == nullptr || !store)
+  {
+    env.setResultMsg("invalid relay parameters");
+    return nullptr;
+  }
+
+  std::unique_ptr<JPEGRelay> relay(new JPEGRelay(env, url, std::move(store)));
+  relay->connect();
+  return relay;
+}
+
+JPEGRelay::JPEGRelay(UsageEnvironment& env, const char* url, std::shared_ptr<JPEGFrameStore> store)
+    : m_env(env), m_url(url), m_store(std::move(store))
+{}
+
+JPEGRelay::~JPEGRelay()
+{
+  m_env.taskScheduler().unscheduleDelayedTask(m_retryTask);
+  teardown();
+}
+
+void JPEGRelay::subscribe(JPEGPassThroughSource* source)
+{
+  m_subscribers.push_back(source);
+}
+
+void JPEGRelay::unsubscribe(JPEGPassThroughSource* source)
+{
+  m_subscribers.erase(std::remove(m_subscribers.begin(), m_subscribers.end(), source), m_subscribers.end());
+}
+
+void JPEGRelay::connect()
+{
+  m_retryTask = nullptr;
+
+  m_client = RelayRTSPClient::createNew(m_env, m_url.c_str(), this);
+  if (m_client == nullptr)
+  {
+    fprintf(stderr, "relay %s: %s\n", m_url.c_str(), m_env.getResultMsg());
+    scheduleRetry();
+    return;
+  }
+  m_client->sendDescribeCommand(continueAfterDESCRIBE);
+}
+
+void JPEGRelay::teardown()
+{
+  if (m_subsession != nullptr && m_subsession->readSource() != nullptr)
+    m_subsession->readSource()->stopGettingFrames();
+  m_subsession = nullptr;
+
+  if (m_session != nullptr)
+  {
+    if (m_client != nullptr)
+      m_client->sendTeardownCommand(*m_session, nullptr);
+    Medium::close(m_session);
+    m_session = nullptr;
+  }
+
+  Medium::close(m_client);
+  m_client     = nullptr;
+  m_assembling = false;
+}
+
+void JPEGRelay::scheduleRetry()
+{
+  teardown();
+  if (m_retryTask == nullptr)
+    m_retryTask = m_env.taskScheduler().scheduleDelayedTask(RELAY_RETRY_SECONDS * 1000000, retry, this);
+}
+
+void JPEGRelay::retry(void* clientData)
+{
+  ((JPEGRelay*)clientData)->connect();
+}
+
+void JPEGRelay::continueAfterDESCRIBE(RTSPClient* client, int resultCode, char* resultString)
+{
+  JPEGRelay* relay = ((RelayRTSPClient*)client)->relay;
+
+  if (resultCode != 0)
+  {
+    fprintf(stderr, "relay %s: DESCRIBE failed: %s\n", relay->m_url.c_str(), resultString ? resultString : "");
+    delete[] resultString;
+    relay->scheduleRetry();
+    return;
+  }
+
+  relay->m_session = RelayMediaSession::createNew(relay->m_env, resultString);
+  delete[] resultString;
+  if (relay->m_session == nullptr)
+  {
+    relay->scheduleRetry();
+    return;
+  }
+
+  MediaSubsessionIterator iter(*relay->m_session);
+  while (MediaSubsession* subsession = iter.next())
+  {
+    if (strcmp(subsession->mediumName(), "video") == 0 && strcmp(subsession->codecName(), "JPEG") == 0)
+    {
+      relay->m_subsession = subsession;
+      break;
+    }
+  }
+
+  if (relay->m_subsession == nullptr || !relay->m_subsession->initiate())
+  {
+    fprintf(stderr, "relay %s: no usable JPEG video stream\n", relay->m_url.c_str());
+    relay->m_subsession = nullptr;
+    relay->scheduleRetry();
+    return;
+  }
+
+  client->sendSetupCommand(*relay->m_subsession, continueAfterSETUP);
+}
+
+void JPEGRelay::continueAfterSETUP(RTSPClient* client, int resultCode, char* resultString)
+{
+  JPEGRelay* relay = ((RelayRTSPClient*)client)->relay;
+
+  if (resultCode != 0)
+  {
+    fprintf(stderr, "relay %s: SETUP failed: %s\n", relay->m_url.c_str(), resultString ? resultString : "");
+    delete[] resultString;
+    relay->scheduleRetry();
+    return;
+  }
+  delete[] resultString;
+
+  client->sendPlayCommand(*relay->m_session, continueAfterPLAY);
+}
+
+void JPEGRelay::continueAfterPLAY(RTSPClient* client, int resultCode, char* resultString)
+{
+  JPEGRelay* relay = ((RelayRTSPClient*)client)->relay;
+
+  if (resultCode != 0)
+  {
+    fprintf(stderr, "relay %s: PLAY failed: %s\n", relay->m_url.c_str(), resultString ? resultString : "");
+    delete[] resultString;
+    relay->scheduleRetry();
+    return;
+  }
+  delete[] resultString;
+
+  printf("Relaying %s\n", relay->m_url.c_str());
+  relay->startReading();
+}
+
+void JPEGRelay::startReading()
+{
+  m_subsession->readSource()->getNextFrame(
+      m_packet, sizeof m_packet, afterGettingPacket, this, onSourceClosure, this);
+}
+
+void JPEGRelay::afterGettingPacket(void*          clientData,
+                                   unsigned       frameSize,
+                                   unsigned       numTruncatedBytes,
+                                   struct timeval presentationTime,
+                                   unsigned /*durationInMicroseconds*/)
+{
+  auto* relay = (JPEGRelay*)clientData;
+
+  if (numTruncatedBytes == 0)
+    relay->handlePacket(frameSize, presentationTime);
+
+  if (relay->m_subsession != nullptr)
+    relay->startReading();
+}
+
+void JPEGRelay::onSourceClosure(void* clientData)
+{
+  auto* relay = (JPEGRelay*)clientData;
+
+  fprintf(stderr, "relay %s: upstream closed\n", relay->m_url.c_str());
+  relay->scheduleRetry();
+}
+
+void JPEGRelay::handlePacket(unsigned size, struct timeval presentationTime)
+{
+  /* type-specific, fragment offset, type, Q, width, height */
+  if (size < 8)
+    return;
+
+  RTPSource* rtp       = m_subsession->rtpSource();
+  bool       marker    = rtp->curPacketMarkerBit();
+  uint32_t   timestamp = rtp->curPacketRTPTimestamp();
+  unsigned   offset    = m_packet[1] << 16 | m_packet[2] << 8 | m_packet[3];
+
+  m_maxPayload = std::max(m_maxPayload, size);
+  if (offset == 0)
+  {
+    m_frameNumber++;
+    m_traceId = TRACE_NEXT_FRAME_ID();
+  }
+
+  /* one copy of the packet, however many clients it is queued for */
+  std::shared_ptr<RelayPacket> shared;
+  if (!m_subscribers.empty() && size <= RELAY_PASSTHROUGH_MAX_PAYLOAD)
+  {
+    shared = std::make_shared<RelayPacket>();
+    memcpy(shared->data, m_packet, size);
+    shared->size             = size;
+    shared->presentationTime = presentationTime;
+    shared->frameNumber      = m_frameNumber;
+    shared->marker           = marker;
+    shared->traceId          = m_traceId;
+  }
+
+  for (JPEGPassThroughSource* source : m_subscribers)
+    source->deliverPacket(shared, m_frameNumber, offset == 0);
+
+  reassemble(m_packet, size, offset, timestamp, marker);
+}
+
+void JPEGRelay::reassemble(const uint8_t* packet, unsigned size, unsigned offset, uint32_t timestamp, bool marker)
+{
+  uint8_t  type = packet[4];
+  uint8_t  q    = packet[5];
+  unsigned pos  = 8;
+  uint16_t dri  = 0;
+
+  if (type >= 64 && type <= 127)
+  {
+    if (size < pos + 4)
+      return;
+    dri = packet[8] << 8 | packet[9];
+    pos += 4;
+  }
+
+  if (offset == 0)
+  {
+    m_assembling = false;
+
+    /* only the two types with defined sampling can have their headers rebuilt */
+    if ((type & 63) > 1)
+      return;
+
+    uint8_t        defaultTables[128];
+    const uint8_t* qtables   = defaultTables;
+    unsigned       precision = 0;
+
+    if (q >= 128)
+    {
+      if (size < pos + 4)
+        return;
+      unsigned tablesPrecision = packet[pos + 1];
+      unsigned length          = packet[pos + 2] << 8 | packet[pos + 3];
+      pos += 4;
+
+      if (length > 0)
+      {
+        if (size < pos + length || length > sizeof m_qtables)
+          return;
+        memcpy(m_qtables, packet + pos, length);
+        m_qtablesLength    = length;
+        m_qtablesPrecision = tablesPrecision;
+        m_qtablesQ         = q;
+        pos += length;
+      }
+      else if (q != m_qtablesQ)
+        return; /* tables were sent with a frame we missed */
+
+      if (m_qtablesLength != ((m_qtablesPrecision & 1) ? 128u : 64u) + ((m_qtablesPrecision & 2) ? 128u : 64u))
+        return;
+      qtables   = m_qtables;
+      precision = m_qtablesPrecision;
+    }
+    else
+      JpegHeaders::make_tables(q, defaultTables, defaultTables + 64);
+
+    m_frame = FrameBufferPool::instance().acquire(RELAY_MAX_FRAME_SZ);
+    if (!m_frame)
+      return;
+
+    m_header.clear();
+    JpegHeaders::make_headers(m_header, type & 63, packet[6], packet[7], qtables, precision, dri);
+    memcpy(m_frame.data(), m_header.data(), m_header.size());
+
+    m_frameSize      = m_header.size();
+    m_frameTimestamp = timestamp;
+    m_assembling     = true;
+  }
+  else if (!m_assembling || timestamp != m_frameTimestamp || m_frameSize != m_header.size() + offset)
+  {
+    /* lost or foreign fragment, wait for the next frame */
+    m_assembling = false;
+    return;
+  }
+
+  unsigned length = size - pos;
+  if (m_frameSize + length + 2 > m_frame.capacity())
+  {
+    m_assembling = false;
+    return;
+  }
+  memcpy(m_frame.data() + m_frameSize, packet + pos, length);
+  m_frameSize += length;
+
+  if (!marker)
+    return;
+  m_assembling = false;
+
+  uint8_t* end = m_frame.data() + m_frameSize;
+  if (end[-2] != JpegParser::JPEG_MARKER || end[-1] != JpegParser::JPEG_MARKER_EOI)
+  {
+    end[0] = JpegParser::JPEG_MARKER;
+    end[1] = JpegParser::JPEG_MARKER_EOI;
+    m_frameSize += 2;
+  }
+
+  TRACE_INSTANT("relay_frame", m_traceId);
+  m_store->publish(std::move(m_frame), m_frameSize, 0, m_traceId);
+}
+
+JPEGPassThroughSource* JPEGPassThroughSource::createNew(UsageEnvironment& env, JPEGRelay* relay)
+{
+  return new JPEGPassThroughSource(env, relay);
+}
+
+JPEGPassThroughSource::JPEGPassThroughSource(UsageEnvironment& env, JPEGRelay* relay)
+    : JPEGPacketSource(env), m_relay(relay)
+{
+  m_relay->subscribe(this);
+}
+
+JPEGPassThroughSource::~JPEGPassThroughSource()
+{
+  m_relay->unsubscribe(this);
+}
+
+void JPEGPassThroughSource::deliverPacket(std::shared_ptr<const RelayPacket> packet,
+                                          uint64_t                           frameNumber,
+                                          bool                               frameStart)
+{
+  if (frameStart)
+    m_skipping = false;
+
+  /* once a packet of a frame has to go, so does the rest of it, queued packets included */
+  if (!m_skipping && (!packet || m_queue.size() == RELAY_PASSTHROUGH_QUEUE))
+  {
+    m_skipping = true;
+    while (!m_queue.empty() && m_queue.back()->frameNumber == frameNumber)
+      m_queue.pop_back();
+  }
+  if (m_skipping)
+    return;
+
+  m_queue.push_back(std::move(packet));
+
+  if (isCurrentlyAwaitingData())
+    deliver();
+}
+
+void JPEGPassThroughSource::doGetNextFrame()
+{
+  if (!m_queue.empty())
+    deliver();
+}
+
+void JPEGPassThroughSource::deliver()
+{
+  std::shared_ptr<const RelayPacket> p = std::move(m_queue.front());
+  m_queue.pop_front();
+
+  fFrameSize         = std::min(p->size, fMaxSize);
+  fNumTruncatedBytes = p->size - fFrameSize;
+  memcpy(fTo, p->data, fFrameSize);
+  fPresentationTime       = p->presentationTime;
+  fDurationInMicroseconds = 0;
+  m_marker                = p->marker;
+  m_traceId               = p->traceId;
+
+  FramedSource::afterGetting(this);
+}
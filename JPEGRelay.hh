@@ -0,0 +1,168 @@
+#pragma once
+
+#include "FrameBufferPool.h"
+#include "JPEGFrameStore.hh"
+#include "JPEGPacketSink.hh"
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Largest upstream frame reassembled, regenerated headers included.
+#define RELAY_MAX_FRAME_SZ (2 * 1024 * 1024)
+
+// Receive buffer for one upstream RTP payload.
+#define RELAY_MAX_PACKET_SZ 65536
+
+// Largest upstream payload forwarded as is.
+#define RELAY_PASSTHROUGH_MAX_PAYLOAD PACKET_SINK_DEFAULT_MAX_PAYLOAD
+
+// Packets a pass-through client may fall behind before it skips the rest of the frame.
+#define RELAY_PASSTHROUGH_QUEUE 64
+
+// Delay before reconnecting once the upstream session failed or ended.
+#define RELAY_RETRY_SECONDS 5
+
+class MediaSession;
+class MediaSubsession;
+class RTSPClient;
+class JPEGPassThroughSource;
+
+// An upstream RTP/JPEG payload, RTP/JPEG header included, as queued for every pass-through client.
+struct RelayPacket
+{
+  uint8_t        data[RELAY_PASSTHROUGH_MAX_PAYLOAD];
+  unsigned       size;
+  struct timeval presentationTime;
+  uint64_t       frameNumber; // upstream frames counted by the relay
+  bool           marker;
+  uint32_t       traceId;
+};
+
+/*
+ * JPEGRelay:
+ *
+ * Pulls an upstream RTSP/RTP JPEG stream and re-serves it. Every upstream
+ * packet is handled twice, both times without touching the entropy-coded data:
+ *
+ *  - reassembled into a frame whose JFIF headers are regenerated from the
+ *    RTP/JPEG header (RFC 2435 Appendix B) and published into a
+ *    JPEGFrameStore, which JPEGFramedSource then serves like any other stream;
+ *  - copied once into a RelayPacket shared by every JPEGPassThroughSource,
+ *    whose sink only puts its own SSRC, sequence number and timestamp in
+ *    front of it.
+ *
+ * Pass-through is only offered while every upstream payload has fitted into
+ * one of our packets, see passThroughCapable().
+ */
+class JPEGRelay
+{
+public:
+  static std::unique_ptr<JPEGRelay> createNew(UsageEnvironment& env, const char* url, std::shared_ptr<JPEGFrameStore> store);
+  ~JPEGRelay();
+
+  JPEGRelay(const JPEGRelay&)            = delete;
+  JPEGRelay& operator=(const JPEGRelay&) = delete;
+
+  // True if upstream packets have been seen and all of them fit our packets unchanged.
+  bool passThroughCapable() const
+  {
+    return m_maxPayload > 0 && m_maxPayload <= RELAY_PASSTHROUGH_MAX_PAYLOAD;
+  }
+
+  void subscribe(JPEGPassThroughSource* source);
+  void unsubscribe(JPEGPassThroughSource* source);
+
+private:
+  JPEGRelay(UsageEnvironment& env, const char* url, std::shared_ptr<JPEGFrameStore> store);
+
+  void connect();
+  void teardown();
+  void scheduleRetry();
+  void startReading();
+  void handlePacket(unsigned size, struct timeval presentationTime);
+  void reassemble(const uint8_t* packet, unsigned size, unsigned offset, uint32_t timestamp, bool marker);
+
+  static void retry(void* clientData);
+  static void continueAfterDESCRIBE(RTSPClient* client, int resultCode, char* resultString);
+  static void continueAfterSETUP(RTSPClient* client, int resultCode, char* resultString);
+  static void continueAfterPLAY(RTSPClient* client, int resultCode, char* resultString);
+  static void afterGettingPacket(void*          clientData,
+                                 unsigned       frameSize,
+                                 unsigned       numTruncatedBytes,
+                                 struct timeval presentationTime,
+                                 unsigned       durationInMicroseconds);
+  static void onSourceClosure(void* clientData);
+
+private:
+  UsageEnvironment&               m_env;
+  std::string                     m_url;
+  std::shared_ptr<JPEGFrameStore> m_store;
+  TaskToken                       m_retryTask = nullptr;
+
+  RTSPClient*      m_client     = nullptr;
+  MediaSession*    m_session    = nullptr;
+  MediaSubsession* m_subsession = nullptr;
+
+  uint8_t  m_packet[RELAY_MAX_PACKET_SZ];
+  unsigned m_maxPayload  = 0;
+  uint64_t m_frameNumber = 0; // of the upstream frame being received
+  uint32_t m_traceId     = 0;
+
+  std::vector<JPEGPassThroughSource*> m_subscribers;
+
+  // frame being reassembled
+  FrameBuffer          m_frame;
+  std::vector<uint8_t> m_header;
+  uint32_t             m_frameSize      = 0;
+  uint32_t             m_frameTimestamp = 0;
+  bool                 m_assembling     = false;
+
+  // in-band tables of Q >= 128 frames, which may only be sent with the first frame using them
+  uint8_t  m_qtables[256];
+  unsigned m_qtablesLength    = 0;
+  unsigned m_qtablesPrecision = 0;
+  int      m_qtablesQ         = -1;
+};
+
+/*
+ * JPEGPassThroughSource:
+ *
+ * Per-client source of the relay's pass-through path. Delivers upstream RTP
+ * payloads one at a time, RTP/JPEG header included, for JPEGPacketSink.
+ * A client that falls RELAY_PASSTHROUGH_QUEUE packets behind drops the rest
+ * of the frame, including its packets still queued, and resumes at the next
+ * one. Packets of that frame already sent cannot be taken back: the client
+ * then gets the frame without its marker packet and discards it, as it would
+ * after any packet loss.
+ *
+ * The packets take live555's per-packet path, RTP-over-RTSP clients
+ * included, not JPEGPacketSink's batched interleaved writes: they arrive
+ * from upstream one at a time, so there is no frame to batch.
+ */
+class JPEGPassThroughSource : public JPEGPacketSource
+{
+public:
+  static JPEGPassThroughSource* createNew(UsageEnvironment& env, JPEGRelay* relay);
+
+  // Called by the relay for every upstream packet of frameNumber; packet is nullptr
+  // for one too large to forward.
+  void deliverPacket(std::shared_ptr<const RelayPacket> packet, uint64_t frameNumber, bool frameStart);
+
+protected:
+  JPEGPassThroughSource(UsageEnvironment& env, JPEGRelay* relay);
+  // called only by createNew()
+  virtual ~JPEGPassThroughSource();
+
+private:
+  // redefined virtual functions:
+  virtual void doGetNextFrame() override;
+
+  void deliver();
+
+private:
+  JPEGRelay*                                     m_relay;
+  std::deque<std::shared_ptr<const RelayPacket>> m_queue;
+  bool                                           m_skipping = true; // until the first frame start
+};
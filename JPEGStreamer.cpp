@@ -0,0 +1,161 @@
+#include "JPEGStreamer.hh"
+#include "FrameTrace.h"
+#include "JPEGHTTPServer.hh"
+#include "JPEGRTSPServer.hh"
+#include "JPEGUnicastSubsession.h"
+#include "OverloadControl.hh"
+
+#include <BasicUsageEnvironment.hh>
+
+#include <cstdio>
+#include <cstring>
+
+std::unique_ptr<JPEGStreamer> JPEGStreamer::createNew(const JPEGStreamerConfig& config)
+{
+  if (config.framerate == 0)
+    return nullptr;
+
+  TaskScheduler*    scheduler = BasicTaskScheduler::createNew();
+  UsageEnvironment* env       = BasicUsageEnvironment::createNew(*scheduler);
+
+  /* from here on the destructor cleans up whatever was created */
+  std::unique_ptr<JPEGStreamer> streamer(new JPEGStreamer(scheduler, env, config));
+
+  streamer->m_rtspServer =
+      JPEGRTSPServer::createNew(*env, config.rtspPort, config.maxSessions, config.maxSessionsPerStream);
+  if (streamer->m_rtspServer == nullptr)
+  {
+    fprintf(stderr, "JPEGStreamer: could not create RTSP server: %s\n", env->getResultMsg());
+    return nullptr;
+  }
+
+  if (config.httpPort != 0)
+  {
+    streamer->m_httpServer = JPEGHTTPServer::createNew(*env, config.httpPort, config.framerate);
+    if (!streamer->m_httpServer)
+    {
+      fprintf(stderr, "JPEGStreamer: could not create HTTP server: %s\n", env->getResultMsg());
+      return nullptr;
+    }
+  }
+
+  OverloadGovernor::instance().start(*env, config.cpuBudget);
+  return streamer;
+}
+
+JPEGStreamer::JPEGStreamer(TaskScheduler* scheduler, UsageEnvironment* env, const JPEGStreamerConfig& config)
+    : m_scheduler(scheduler), m_env(env), m_config(config)
+{
+  m_trigger = m_scheduler->createEventTrigger(framesPushed);
+}
+
+JPEGStreamer::~JPEGStreamer()
+{
+  m_scheduler->deleteEventTrigger(m_trigger);
+
+  m_httpServer.reset();
+  if (m_rtspServer != nullptr)
+    Medium::close(m_rtspServer);
+  for (auto& stream : m_streams)
+    stream.reset();
+
+  m_env->reclaim();
+  delete m_scheduler;
+}
+
+int JPEGStreamer::addStream(const char* name)
+{
+  int id = m_streamCount.load(std::memory_order_relaxed);
+  if (id >= STREAMER_MAX_STREAMS)
+  {
+    m_env->setResultMsg("too many streams");
+    return -1;
+  }
+
+  auto stream   = std::make_unique<Stream>();
+  stream->store = JPEGFrameStore::create(name);
+
+  /* the subsession finds the store just created by name, clients can SETUP once the first frame is in */
+  JPEGServerMediaSubsession* subsession =
+      JPEGServerMediaSubsession::createNew(*m_env, name, m_config.framerate, false, m_config.keepAliveMs);
+  if (subsession == nullptr)
+    return -1;
+
+  ServerMediaSession* sms = ServerMediaSession::createNew(*m_env, name, name, "Pushed JPEG stream", False);
+  sms->addSubsession(subsession);
+  m_rtspServer->addServerMediaSession(sms);
+
+  if (m_httpServer)
+    m_httpServer->addStream(name, stream->store);
+
+  m_streams[id] = std::move(stream);
+  m_streamCount.store(id + 1, std::memory_order_release);
+  return id;
+}
+
+bool JPEGStreamer::pushFrame(int streamId, FrameBuffer buffer, uint32_t length, uint64_t captureTimeUs)
+{
+  if (streamId < 0 || streamId >= m_streamCount.load(std::memory_order_acquire))
+    return false;
+  if (!buffer || length == 0 || length > buffer.capacity())
+    return false;
+
+  PushedFrame frame;
+  frame.buffer        = std::move(buffer);
+  frame.length        = length;
+  frame.captureTimeUs = captureTimeUs;
+  frame.traceId       = TRACE_NEXT_FRAME_ID();
+  TRACE_INSTANT("push", frame.traceId);
+  if (!m_streams[streamId]->queue.push(std::move(frame)))
+    return false;
+
+  m_scheduler->triggerEvent(m_trigger, this);
+  return true;
+}
+
+bool JPEGStreamer::pushFrame(int streamId, const uint8_t* bytes, uint32_t length, uint64_t captureTimeUs)
+{
+  FrameBuffer buffer = allocateFrame(length);
+  if (!buffer)
+    return false;
+
+  memcpy(buffer.data(), bytes, length);
+  return pushFrame(streamId, std::move(buffer), length, captureTimeUs);
+}
+
+void JPEGStreamer::run()
+{
+  m_scheduler->doEventLoop(&m_stop);
+}
+
+void JPEGStreamer::stop()
+{
+  m_stop = 1;
+  m_scheduler->triggerEvent(m_trigger, this);
+}
+
+void JPEGStreamer::framesPushed(void* clientData)
+{
+  ((JPEGStreamer*)clientData)->framesPushed();
+}
+
+void JPEGStreamer::framesPushed()
+{
+  int count = m_streamCount.load(std::memory_order_acquire);
+  for (int i = 0; i < count; i++)
+  {
+    Stream& stream = *m_streams[i];
+
+    /* a store only holds its newest frame, anything queued behind it was overtaken already */
+    PushedFrame frame, newest;
+    while (stream.queue.pop(frame))
+      newest = std::move(frame);
+    if (!newest.buffer)
+      continue;
+
+    TRACE_INSTANT("pushed_frame", newest.traceId);
+    if (!stream.store->publish(std::move(newest.buffer), newest.length, newest.captureTimeUs, newest.traceId))
+      *m_env << "JPEGStreamer: dropped a frame pushed to \"" << stream.store->fileName().c_str()
+             << "\" that is not a usable JPEG\n";
+  }
+}
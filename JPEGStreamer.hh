@@ -0,0 +1,127 @@
+#pragma once
+
+#include "FrameBufferPool.h"
+#include "FrameQueue.h"
+#include "JPEGFrameStore.hh"
+
+#include <UsageEnvironment.hh>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Streams one JPEGStreamer can serve.
+#define STREAMER_MAX_STREAMS 16
+
+// Frames a stream may have queued before pushFrame() refuses more; a power of two.
+#define STREAMER_QUEUE_DEPTH 8
+
+class JPEGHTTPServer;
+class JPEGRTSPServer;
+
+struct JPEGStreamerConfig
+{
+  uint16_t rtspPort             = 7070;
+  uint16_t httpPort             = 0;  // 0 for RTSP only
+  unsigned framerate            = 25; // rate frames are sent to clients, whatever rate they are pushed at
+  unsigned keepAliveMs          = 0;  // see JPEGFramedSource::createNew()
+  unsigned maxSessions          = 0;  // see JPEGRTSPServer::createNew()
+  unsigned maxSessionsPerStream = 0;
+  unsigned cpuBudget            = 0;  // see OverloadGovernor::start()
+};
+
+/*
+ * JPEGStreamer:
+ *
+ * The streamer as a library, for applications that produce JPEGs themselves
+ * and want to serve them in-process instead of through a file or FIFO.
+ * Owns its scheduler, RTSP server and optional HTTP server; run() is the event
+ * loop and is meant to get a thread of its own.
+ *
+ *   auto streamer = JPEGStreamer::createNew(config);
+ *   int  camera   = streamer->addStream("camera");
+ *   std::thread loop([&] { streamer->run(); });
+ *
+ *   FrameBuffer frame = JPEGStreamer::allocateFrame(size);  // encode into frame.data()
+ *   streamer->pushFrame(camera, std::move(frame), size, captureTimeUs);
+ *
+ * pushFrame() may be called from any thread. It moves the frame's handle into
+ * a lock-free queue per stream and wakes the event loop with an event trigger,
+ * which publishes the newest queued frame of each stream into its
+ * JPEGFrameStore. From there the frame goes out like any other: RTSP clients
+ * read it straight from the pooled buffer, so a frame encoded into a buffer
+ * from allocateFrame() is never copied on its way to the network.
+ */
+class JPEGStreamer
+{
+public:
+  static std::unique_ptr<JPEGStreamer> createNew(const JPEGStreamerConfig& config);
+  ~JPEGStreamer();
+
+  JPEGStreamer(const JPEGStreamer&)            = delete;
+  JPEGStreamer& operator=(const JPEGStreamer&) = delete;
+
+  // Before run() or from the event loop. Serves rtsp://<host>:<port>/<name>
+  // (and /<name>/mjpeg over HTTP), returns the id to push frames to or -1.
+  int addStream(const char* name);
+
+  // Any thread. A pooled buffer of at least size bytes to encode a frame into.
+  static FrameBuffer allocateFrame(size_t size)
+  {
+    return FrameBufferPool::instance().acquire(size);
+  }
+
+  // Any thread. Hands length bytes of a JFIF image in buffer over to the stream.
+  // captureTimeUs is the wall-clock (gettimeofday) time the image was captured
+  // and becomes the frame's presentation time; 0 uses the time it is sent.
+  // Returns false, dropping the frame, if the stream's queue is full.
+  bool pushFrame(int streamId, FrameBuffer buffer, uint32_t length, uint64_t captureTimeUs = 0);
+
+  // Any thread. As above for a frame that is not in a pooled buffer, which is copied into one.
+  bool pushFrame(int streamId, const uint8_t* bytes, uint32_t length, uint64_t captureTimeUs = 0);
+
+  // Runs the event loop until stop() is called.
+  void run();
+
+  // Any thread. Makes run() return.
+  void stop();
+
+  UsageEnvironment& envir() const
+  {
+    return *m_env;
+  }
+
+private:
+  struct PushedFrame
+  {
+    FrameBuffer buffer;
+    uint32_t    length        = 0;
+    uint64_t    captureTimeUs = 0;
+    uint32_t    traceId       = 0;
+  };
+
+  struct Stream
+  {
+    std::shared_ptr<JPEGFrameStore>                 store;
+    FrameQueue<PushedFrame, STREAMER_QUEUE_DEPTH> queue;
+  };
+
+  JPEGStreamer(TaskScheduler* scheduler, UsageEnvironment* env, const JPEGStreamerConfig& config);
+
+  static void framesPushed(void* clientData);
+  void        framesPushed();
+
+private:
+  TaskScheduler*     m_scheduler;
+  UsageEnvironment*  m_env;
+  JPEGStreamerConfig m_config;
+  JPEGRTSPServer*    m_rtspServer = nullptr;
+  EventTriggerId     m_trigger    = 0;
+  char volatile      m_stop       = 0;
+
+  std::unique_ptr<JPEGHTTPServer> m_httpServer;
+
+  // filled by addStream() only, published to producers through m_streamCount
+  std::unique_ptr<Stream> m_streams[STREAMER_MAX_STREAMS];
+  std::atomic<int>        m_streamCount{0};
+};
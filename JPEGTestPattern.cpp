@@ -0,0 +1,254 @@
+#include "JPEGTestPattern.hh"
+#include "JPEGHeaders.h"
+#include "JPEGParser.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+
+  using JpegHeaders::BitWriter;
+  using JpegHeaders::HuffTable;
+  using JpegHeaders::magnitude_bits;
+
+  const HuffTable k_dcLuma(JpegHeaders::dc_luma_bits, JpegHeaders::dc_vals);
+  const HuffTable k_dcChroma(JpegHeaders::dc_chroma_bits, JpegHeaders::dc_vals);
+  const HuffTable k_acLuma(JpegHeaders::ac_luma_bits, JpegHeaders::ac_luma_vals);
+  const HuffTable k_acChroma(JpegHeaders::ac_chroma_bits, JpegHeaders::ac_chroma_vals);
+
+  // coef is in zigzag order
+  void encodeBlock(BitWriter& bw, const int16_t coef[64], int& predictor, const HuffTable& dc, const HuffTable& ac)
+  {
+    int      diff = coef[0] - predictor;
+    unsigned cat  = magnitude_bits(diff);
+    predictor     = coef[0];
+
+    bw.put(dc.code[cat], dc.size[cat]);
+    if (cat)
+      bw.put(diff < 0 ? diff - 1 : diff, cat);
+
+    unsigned run = 0;
+    for (unsigned k = 1; k < 64; k++)
+    {
+      if (coef[k] == 0)
+      {
+        run++;
+        continue;
+      }
+      for (; run > 15; run -= 16)
+        bw.put(ac.code[0xF0], ac.size[0xF0]);
+
+      cat         = magnitude_bits(coef[k]);
+      uint8_t sym = (run << 4) | cat;
+      bw.put(ac.code[sym], ac.size[sym]);
+      bw.put(coef[k] < 0 ? coef[k] - 1 : coef[k], cat);
+      run = 0;
+    }
+    if (run > 0)
+      bw.put(ac.code[0x00], ac.size[0x00]); /* EOB */
+  }
+
+} // namespace
+
+std::unique_ptr<JPEGTestPattern> JPEGTestPattern::createNew(UsageEnvironment&               env,
+                                                            std::shared_ptr<JPEGFrameStore> store,
+                                                            const TestPatternParams&        params,
+                                                            unsigned                        framerate)
+{
+  if (!store || framerate == 0 || params.width < 16 || params.height < 16 || params.width > 2040 ||
+      params.height > 2040 || params.quality < 1 || params.quality > 100 || params.variants == 0)
+  {
+    env.setResultMsg("invalid test pattern parameters");
+    return nullptr;
+  }
+
+  std::unique_ptr<JPEGTestPattern> pattern(new JPEGTestPattern(env, std::move(store), params, framerate));
+  if (!pattern->m_store->current())
+  {
+    env.setResultMsg("could not produce a test pattern frame");
+    return nullptr;
+  }
+  return pattern;
+}
+
+JPEGTestPattern::JPEGTestPattern(UsageEnvironment&               env,
+                                 std::shared_ptr<JPEGFrameStore> store,
+                                 const TestPatternParams&        params,
+                                 unsigned                        framerate)
+    : m_env(env), m_store(std::move(store)), m_params(params), m_framerate(framerate)
+{
+  /* 4:2:0, 16x16 pixel MCUs */
+  m_mcusPerRow = m_params.width / 16;
+  m_mcuRows    = m_params.height / 16;
+
+  JpegHeaders::make_tables(m_params.quality, m_quant[0], m_quant[1]);
+
+  buildHeader();
+  buildRows();
+
+  size_t maxBand = 0, maxRow = 0;
+  for (auto& band : m_bands)
+    maxBand = std::max(maxBand, band.size());
+  for (auto& row : m_rows)
+    maxRow = std::max(maxRow, row.size());
+  m_maxFrameSize = m_header.size() + maxBand + (m_mcuRows - 1) * maxRow + 2 * m_mcuRows;
+
+  printf("Test pattern %ux%u q%u: %u MCU rows, up to %zu bytes per frame\n",
+         m_mcusPerRow * 16,
+         m_mcuRows * 16,
+         m_params.quality,
+         m_mcuRows,
+         m_maxFrameSize);
+
+  produceFrame();
+  m_task = m_env.taskScheduler().scheduleDelayedTask(1000000 / m_framerate, tick, this);
+}
+
+JPEGTestPattern::~JPEGTestPattern()
+{
+  m_env.taskScheduler().unscheduleDelayedTask(m_task);
+}
+
+void JPEGTestPattern::buildHeader()
+{
+  /* type 1 (4:2:0) with one restart interval per MCU row, so rows can be stitched in any order */
+  JpegHeaders::make_headers(m_header, 1, m_mcusPerRow * 2, m_mcuRows * 2, &m_quant[0][0], 0, m_mcusPerRow);
+}
+
+void JPEGTestPattern::buildRows()
+{
+  int16_t coef[64];
+  int     lumaDC[2] = {(int)((16 - 128) * 8 / m_quant[0][0]), (int)((235 - 128) * 8 / m_quant[0][0])};
+
+  /* overlay band: top blocks show the counter in binary, bottom blocks a bar sweeping across */
+  unsigned columns = m_mcusPerRow * 2;
+  m_bands.resize(m_params.variants);
+  for (unsigned v = 0; v < m_params.variants; v++)
+  {
+    BitWriter bw(m_bands[v]);
+    int       pred[3] = {0, 0, 0};
+
+    for (unsigned mcu = 0; mcu < m_mcusPerRow; mcu++)
+    {
+      for (unsigned b = 0; b < 4; b++)
+      {
+        unsigned column = mcu * 2 + (b & 1);
+        bool     bright = b < 2 ? column < 32 && ((v >> column) & 1) : column == v * columns / m_params.variants;
+
+        memset(coef, 0, sizeof coef);
+        coef[0] = lumaDC[bright];
+        encodeBlock(bw, coef, pred[0], k_dcLuma, k_acLuma);
+      }
+      memset(coef, 0, sizeof coef);
+      encodeBlock(bw, coef, pred[1], k_dcChroma, k_acChroma);
+      encodeBlock(bw, coef, pred[2], k_dcChroma, k_acChroma);
+    }
+    bw.flush();
+  }
+
+  /* body rows: luma texture of `density` random low-frequency AC coefficients per block */
+  auto encodeRow = [&](unsigned density, unsigned seed, int level) {
+    std::vector<uint8_t> row;
+    BitWriter            bw(row);
+    int                  pred[3] = {0, 0, 0};
+    uint32_t             random  = seed * 2654435761u + 1;
+
+    for (unsigned mcu = 0; mcu < m_mcusPerRow; mcu++)
+    {
+      for (unsigned b = 0; b < 4; b++)
+      {
+        memset(coef, 0, sizeof coef);
+        coef[0] = level;
+        for (unsigned k = 1; k <= density; k++)
+        {
+          random     = random * 1103515245u + 12345u;
+          int value  = (int)((random >> 16) % 7) + 1;
+          coef[k]    = (random >> 8) & 1 ? value : -value;
+        }
+        encodeBlock(bw, coef, pred[0], k_dcLuma, k_acLuma);
+      }
+      memset(coef, 0, sizeof coef);
+      encodeBlock(bw, coef, pred[1], k_dcChroma, k_acChroma);
+      encodeBlock(bw, coef, pred[2], k_dcChroma, k_acChroma);
+    }
+    bw.flush();
+    return row;
+  };
+
+  int grey = (128 - 128) * 8 / m_quant[0][0];
+  if (m_params.frameBytes == 0 || m_mcuRows < 2)
+  {
+    m_rows.push_back(encodeRow(0, 0, grey));
+    return;
+  }
+
+  size_t fixed = m_header.size() + m_bands[0].size() + 2 * m_mcuRows;
+  size_t target = m_params.frameBytes > fixed ? (m_params.frameBytes - fixed) / (m_mcuRows - 1) : 0;
+
+  /* coded size grows with density, find the smallest one that reaches the target */
+  unsigned lo = 0, hi = 63;
+  while (lo < hi)
+  {
+    unsigned mid = (lo + hi) / 2;
+    if (encodeRow(mid, 0, grey).size() < target)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 63 && encodeRow(63, 0, grey).size() < target)
+    fprintf(stderr, "test pattern: %u bytes per frame is more than %ux%u can carry\n",
+            m_params.frameBytes,
+            m_mcusPerRow * 16,
+            m_mcuRows * 16);
+
+  /* alternate the density around the target so frame sizes jitter like a real scene */
+  for (unsigned i = 0; i < TEST_PATTERN_ROW_VARIANTS; i++)
+  {
+    unsigned density = (i & 1) ? lo : (lo > 0 ? lo - 1 : 0);
+    m_rows.push_back(encodeRow(density, i + 1, grey + (int)i - TEST_PATTERN_ROW_VARIANTS / 2));
+  }
+}
+
+void JPEGTestPattern::tick(void* clientData)
+{
+  auto* pattern   = (JPEGTestPattern*)clientData;
+  pattern->m_task = pattern->m_env.taskScheduler().scheduleDelayedTask(1000000 / pattern->m_framerate, tick, pattern);
+  pattern->produceFrame();
+}
+
+void JPEGTestPattern::produceFrame()
+{
+  FrameBuffer buffer = FrameBufferPool::instance().acquire(m_maxFrameSize);
+  if (!buffer)
+    return;
+
+  uint8_t* out = buffer.data();
+  size_t   pos = 0;
+
+  memcpy(out, m_header.data(), m_header.size());
+  pos += m_header.size();
+
+  const std::vector<uint8_t>& band = m_bands[m_frameCount % m_bands.size()];
+  memcpy(out + pos, band.data(), band.size());
+  pos += band.size();
+
+  for (unsigned r = 1; r < m_mcuRows; r++)
+  {
+    out[pos++] = JpegParser::JPEG_MARKER;
+    out[pos++] = 0xD0 + ((r - 1) & 7); /* RSTn */
+
+    m_random                         = m_random * 1664525u + 1013904223u;
+    const std::vector<uint8_t>& row = m_rows[(m_random >> 16) % m_rows.size()];
+    memcpy(out + pos, row.data(), row.size());
+    pos += row.size();
+  }
+
+  out[pos++] = JpegParser::JPEG_MARKER;
+  out[pos++] = JpegParser::JPEG_MARKER_EOI;
+
+  m_frameCount++;
+  m_store->publish(std::move(buffer), pos);
+}
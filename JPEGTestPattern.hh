@@ -0,0 +1,84 @@
+#pragma once
+
+#include "FrameBufferPool.h"
+#include "JPEGFrameStore.hh"
+
+#include <UsageEnvironment.hh>
+
+#include <memory>
+#include <vector>
+
+// Number of distinct overlay bands, i.e. frames before the pattern repeats.
+#define TEST_PATTERN_DEFAULT_VARIANTS 256
+
+// Pre-encoded variants per textured row, picked per frame for realistic size jitter.
+#define TEST_PATTERN_ROW_VARIANTS 4
+
+struct TestPatternParams
+{
+  unsigned width      = 640;
+  unsigned height     = 480;
+  unsigned quality    = 75; // 1..100, scales the standard tables as libjpeg does
+  unsigned frameBytes = 0;  // target frame size, 0 for a flat (smallest) pattern
+  unsigned variants   = TEST_PATTERN_DEFAULT_VARIANTS;
+};
+
+/*
+ * JPEGTestPattern:
+ *
+ * Synthetic high-rate frame producer for load tests. Every MCU row of the
+ * picture is one restart interval (DRI = MCUs per row), encoded once at
+ * startup with the RFC 2435 standard Huffman tables. A frame is then just the
+ * header, a choice of pre-encoded rows and RSTn markers, so frames can be
+ * produced at hundreds of fps without an encoder in the loop.
+ *
+ * The first MCU row is an overlay band carrying the frame counter as bright
+ * and dark blocks, rotated through `variants` encodings so consecutive frames
+ * differ. The remaining rows are either flat or textured with random AC
+ * coefficients sized to approach frameBytes.
+ *
+ * Frames are published into a JPEGFrameStore at the given rate, from where
+ * JPEGFramedSource serves them like any other stream.
+ */
+class JPEGTestPattern
+{
+public:
+  static std::unique_ptr<JPEGTestPattern> createNew(UsageEnvironment&               env,
+                                                    std::shared_ptr<JPEGFrameStore> store,
+                                                    const TestPatternParams&        params,
+                                                    unsigned                        framerate);
+  ~JPEGTestPattern();
+
+  JPEGTestPattern(const JPEGTestPattern&)            = delete;
+  JPEGTestPattern& operator=(const JPEGTestPattern&) = delete;
+
+private:
+  JPEGTestPattern(UsageEnvironment& env, std::shared_ptr<JPEGFrameStore> store, const TestPatternParams& params, unsigned framerate);
+
+  void buildHeader();
+  void buildRows();
+  void produceFrame();
+
+  static void tick(void* clientData);
+
+private:
+  UsageEnvironment&               m_env;
+  std::shared_ptr<JPEGFrameStore> m_store;
+  TestPatternParams               m_params;
+  unsigned                        m_framerate;
+  TaskToken                       m_task = nullptr;
+
+  unsigned m_mcusPerRow;
+  unsigned m_mcuRows;
+
+  uint8_t m_quant[2][64]; // zigzag order, as in DQT
+
+  std::vector<uint8_t>              m_header; // SOI up to and including SOS
+  std::vector<std::vector<uint8_t>> m_bands;  // overlay band per variant
+  // body rows: pre-encoded variants for textured patterns, a single flat row otherwise
+  std::vector<std::vector<uint8_t>> m_rows;
+  size_t                            m_maxFrameSize = 0;
+
+  uint64_t m_frameCount = 0;
+  uint32_t m_random     = 0x9E3779B9;
+};
@@ -3,31 +3,254 @@
 //
 
 #include "JPEGUnicastSubsession.h"
+#include "FrameTrace.h"
+#include "JPEGCutThroughSource.hh"
 #include "JPEGFramedSource.hh"
+#include "JPEGPacketSink.hh"
+#include "JPEGRelay.hh"
 #include <JPEGVideoRTPSink.hh>
-JPEGServerMediaSubsession* JPEGServerMediaSubsession::createNew(UsageEnvironment& env, const char* fileName)
+#include <TLSState.hh>
+
+#include <cstdio>
+#include <sys/socket.h>
+
+// RFC 3551 static payload type for JPEG
+#define JPEG_RTP_PAYLOAD_TYPE 26
+
+// Bitrate announced for live inputs, whose frame size is unknown until they play
+#define LIVE_ESTIMATED_KBPS 5000
+
+JPEGServerMediaSubsession* JPEGServerMediaSubsession::createNew(UsageEnvironment& env,
+                                                                const char*       fileName,
+                                                                unsigned          framerate,
+                                                                bool              lowLatency,
+                                                                unsigned          keepAliveMs,
+                                                                JPEGRelay*        relay)
 {
   try
   {
-    return new JPEGServerMediaSubsession(env, fileName);
+    return new JPEGServerMediaSubsession(env, fileName, framerate, lowLatency, keepAliveMs, relay);
   }
   catch (...)
   {}
   return nullptr;
 }
 
-JPEGServerMediaSubsession::JPEGServerMediaSubsession(UsageEnvironment& env, const char* fileName)
-    : FileServerMediaSubsession(env, fileName, False)
-{}
+JPEGServerMediaSubsession::JPEGServerMediaSubsession(UsageEnvironment& env,
+                                                     const char*       fileName,
+                                                     unsigned          framerate,
+                                                     bool              lowLatency,
+                                                     unsigned          keepAliveMs,
+                                                     JPEGRelay*        relay)
+    : FileServerMediaSubsession(env, fileName, lowLatency),
+      m_framerate(framerate),
+      m_lowLatency(lowLatency),
+      m_keepAliveMs(keepAliveMs),
+      m_relay(relay)
+{
+  if (!m_lowLatency)
+  {
+    m_store = JPEGFrameStore::lookup(fileName);
+    if (!m_store)
+    {
+      env.setResultMsg("could not load ", fileName);
+      throw std::exception();
+    }
+  }
+}
+
+JPEGServerMediaSubsession* JPEGServerMediaSubsession::createRegion(const JpegCrop::Region& region)
+{
+  if (m_lowLatency)
+    return nullptr;
+
+  auto store = JPEGFrameStore::crop(m_store, region);
+
+  /* refuse regions the current frame cannot be cropped to, e.g. ones lying outside it */
+  store->refresh();
+  if (m_store->current() && !store->current())
+    return nullptr;
+
+  /* the crop store is registered under this name, so the constructor's lookup finds it */
+  return createNew(envir(), store->fileName().c_str(), m_framerate, false, m_keepAliveMs);
+}
+
+char const* JPEGServerMediaSubsession::sdpLines(int addressFamily)
+{
+  unsigned generation = 0;
+  if (m_store)
+  {
+    m_store->refresh();
+    generation = m_store->formatGeneration();
+  }
+
+  if (fSDPLines != nullptr && generation == m_sdpGeneration && addressFamily == m_sdpAddressFamily)
+    return fSDPLines;
+
+  unsigned estBitrate = LIVE_ESTIMATED_KBPS;
+  char     dimensions[64] = "";
+  if (m_store)
+  {
+    auto frame = m_store->current();
+    if (frame)
+      estBitrate = (frame->length * 8 * m_framerate + 999) / 1000;
+    if (frame && frame->payload.width > 0 && frame->payload.height > 0)
+      snprintf(dimensions,
+               sizeof dimensions,
+               "a=x-dimensions:%d,%d\r\n",
+               frame->payload.width * 8,
+               frame->payload.height * 8);
+  }
+
+  char sdp[512];
+  snprintf(sdp,
+           sizeof sdp,
+           "m=video 0 RTP/AVP %d\r\n"
+           "c=IN %s\r\n"
+           "b=AS:%u\r\n"
+           "a=range:npt=0-\r\n"
+           "a=framerate:%u\r\n"
+           "%s"
+           "a=control:%s\r\n",
+           JPEG_RTP_PAYLOAD_TYPE,
+           addressFamily == AF_INET6 ? "IP6 ::" : "IP4 0.0.0.0",
+           estBitrate,
+           m_framerate,
+           dimensions,
+           trackId());
+
+  delete[] fSDPLines;
+  fSDPLines = new char[strlen(sdp) + 1];
+  strcpy(fSDPLines, sdp);
+
+  m_sdpGeneration    = generation;
+  m_sdpAddressFamily = addressFamily;
+
+  return fSDPLines;
+}
 
 FramedSource* JPEGServerMediaSubsession::createNewStreamSource(unsigned int clientSessionId, unsigned int& estBitrate)
 {
-  return JPEGFramedSource::createNew(envir(), estBitrate);
+  if (m_lowLatency)
+  {
+    estBitrate = LIVE_ESTIMATED_KBPS;
+    return JPEGCutThroughSource::createNew(envir(), fFileName, m_framerate);
+  }
+
+  auto frame = m_store->current();
+  estBitrate = frame ? (frame->length * 8 * m_framerate + 999) / 1000 : LIVE_ESTIMATED_KBPS;
+
+  if (m_relay != nullptr && m_relay->passThroughCapable())
+    return JPEGPassThroughSource::createNew(envir(), m_relay);
+  return JPEGFramedSource::createNew(envir(), m_store, m_framerate, m_keepAliveMs);
 }
 
 RTPSink* JPEGServerMediaSubsession::createNewRTPSink(Groupsock*    rtpGroupsock,
                                                      unsigned char rtpPayloadTypeIfDynamic,
                                                      FramedSource* inputSource)
 {
-  return JPEGRTPSink::createNew(envir(), rtpGroupsock);
+  if (m_lowLatency)
+    return JPEGRTPSink::createNew(envir(), rtpGroupsock, (JPEGCutThroughSource*)inputSource);
+
+  /* stored frames and relay pass-through both arrive as ready-made RTP/JPEG payloads */
+  return JPEGPacketSink::createNew(envir(), rtpGroupsock, (JPEGPacketSource*)inputSource);
+}
+
+void JPEGServerMediaSubsession::getStreamParameters(unsigned                       clientSessionId,
+                                                    struct sockaddr_storage const& clientAddress,
+                                                    Port const&                    clientRTPPort,
+                                                    Port const&                    clientRTCPPort,
+                                                    int                            tcpSocketNum,
+                                                    unsigned char                  rtpChannelId,
+                                                    unsigned char                  rtcpChannelId,
+                                                    TLSState*                      tlsState,
+                                                    struct sockaddr_storage&       destinationAddress,
+                                                    u_int8_t&                      destinationTTL,
+                                                    Boolean&                       isMulticast,
+                                                    Port&                          serverRTPPort,
+                                                    Port&                          serverRTCPPort,
+                                                    void*&                         streamToken)
+{
+  FileServerMediaSubsession::getStreamParameters(clientSessionId,
+                                                 clientAddress,
+                                                 clientRTPPort,
+                                                 clientRTCPPort,
+                                                 tcpSocketNum,
+                                                 rtpChannelId,
+                                                 rtcpChannelId,
+                                                 tlsState,
+                                                 destinationAddress,
+                                                 destinationTTL,
+                                                 isMulticast,
+                                                 serverRTPPort,
+                                                 serverRTCPPort,
+                                                 streamToken);
+
+  /* a TLS connection has to go through live555, which does the encryption */
+  if (tcpSocketNum >= 0 && (tlsState == nullptr || !tlsState->isNeeded))
+    m_interleaved[clientSessionId] = {tcpSocketNum, rtpChannelId};
+}
+
+void JPEGServerMediaSubsession::startStream(unsigned                             clientSessionId,
+                                            void*                                streamToken,
+                                            TaskFunc*                            rtcpRRHandler,
+                                            void*                                rtcpRRHandlerClientData,
+                                            unsigned short&                      rtpSeqNum,
+                                            unsigned&                            rtpTimestamp,
+                                            ServerRequestAlternativeByteHandler* serverRequestAlternativeByteHandler,
+                                            void* serverRequestAlternativeByteHandlerClientData)
+{
+#ifdef JPEG_TRACE
+  RRHook& hook = m_rrHooks[clientSessionId];
+  hook         = {rtcpRRHandler, rtcpRRHandlerClientData, clientSessionId};
+
+  rtcpRRHandler           = onRTCPRR;
+  rtcpRRHandlerClientData = &hook;
+#endif
+
+  FileServerMediaSubsession::startStream(clientSessionId,
+                                         streamToken,
+                                         rtcpRRHandler,
+                                         rtcpRRHandlerClientData,
+                                         rtpSeqNum,
+                                         rtpTimestamp,
+                                         serverRequestAlternativeByteHandler,
+                                         serverRequestAlternativeByteHandlerClientData);
+
+  auto interleaving = m_interleaved.find(clientSessionId);
+  if (!m_lowLatency && interleaving != m_interleaved.end() && streamToken != nullptr)
+  {
+    auto* sink = (JPEGPacketSink*)((StreamState*)streamToken)->rtpSink();
+    if (sink != nullptr && !sink->interleaved())
+      sink->setInterleaved(interleaving->second.socketNum, interleaving->second.channelId);
+  }
+}
+
+void JPEGServerMediaSubsession::deleteStream(unsigned clientSessionId, void*& streamToken)
+{
+  /* live555 deletes the streams of a closing RTSP connection before it closes the socket */
+  auto interleaving = m_interleaved.find(clientSessionId);
+  if (!m_lowLatency && interleaving != m_interleaved.end() && streamToken != nullptr)
+  {
+    auto* sink = (JPEGPacketSink*)((StreamState*)streamToken)->rtpSink();
+    if (sink != nullptr)
+      sink->stopInterleaved();
+  }
+
+  FileServerMediaSubsession::deleteStream(clientSessionId, streamToken);
+  m_interleaved.erase(clientSessionId);
+#ifdef JPEG_TRACE
+  m_rrHooks.erase(clientSessionId);
+#endif
+}
+
+#ifdef JPEG_TRACE
+void JPEGServerMediaSubsession::onRTCPRR(void* clientData)
+{
+  auto* hook = (RRHook*)clientData;
+
+  TRACE_INSTANT("rtcp_rr", hook->clientSessionId);
+  if (hook->handler != nullptr)
+    hook->handler(hook->clientData);
 }
+#endif
@@ -1,18 +1,104 @@
 #pragma once
 
+#include "JPEGFrameStore.hh"
+
 #include <FileServerMediaSubsession.hh>
+#include <map>
+#include <memory>
+
+class JPEGRelay;
 
 class JPEGServerMediaSubsession : public FileServerMediaSubsession
 {
 public:
-  static JPEGServerMediaSubsession* createNew(UsageEnvironment& env, char const* fileName);
+  // With lowLatency set, fileName is a live input (e.g. a FIFO of back-to-back JPEGs)
+  // streamed with cut-through packetization by JPEGCutThroughSource. Its clients share
+  // one source and sink, since concurrent readers of a FIFO would split its bytes.
+  // keepAliveMs enables duplicate-frame suppression, see JPEGFramedSource::createNew().
+  // With a relay, fileName names the relay's frame store and clients are served through
+  // the relay's pass-through path whenever it is usable.
+  static JPEGServerMediaSubsession* createNew(UsageEnvironment& env,
+                                              char const*       fileName,
+                                              unsigned          framerate,
+                                              bool              lowLatency  = false,
+                                              unsigned          keepAliveMs = 0,
+                                              JPEGRelay*        relay       = nullptr);
+
+  // A subsession for region of this one's stream, sharing its frame rate and keep-alive.
+  // nullptr for live inputs, whose frames are never stored whole, and for regions the
+  // current frame cannot be cropped to.
+  JPEGServerMediaSubsession* createRegion(const JpegCrop::Region& region);
 
 private:
-  JPEGServerMediaSubsession(UsageEnvironment& env, const char* fileName);
+  JPEGServerMediaSubsession(UsageEnvironment& env,
+                            const char*       fileName,
+                            unsigned          framerate,
+                            bool              lowLatency,
+                            unsigned          keepAliveMs,
+                            JPEGRelay*        relay);
 
 private: // redefined virtual functions
+  // Built from the frame store's parsed header instead of a throwaway source/sink pair,
+  // and cached until the stream's content changes.
+  virtual char const*   sdpLines(int addressFamily);
+  // Note the RTSP connection of RTP-over-RTSP clients, whose packets JPEGPacketSink then writes itself.
+  virtual void getStreamParameters(unsigned                       clientSessionId,
+                                   struct sockaddr_storage const& clientAddress,
+                                   Port const&                    clientRTPPort,
+                                   Port const&                    clientRTCPPort,
+                                   int                            tcpSocketNum,
+                                   unsigned char                  rtpChannelId,
+                                   unsigned char                  rtcpChannelId,
+                                   TLSState*                      tlsState,
+                                   struct sockaddr_storage&       destinationAddress,
+                                   u_int8_t&                      destinationTTL,
+                                   Boolean&                       isMulticast,
+                                   Port&                          serverRTPPort,
+                                   Port&                          serverRTCPPort,
+                                   void*&                         streamToken);
+  // With JPEG_TRACE, also wraps the server's RTCP RR handler to trace receiver reports.
+  virtual void startStream(unsigned                             clientSessionId,
+                           void*                                streamToken,
+                           TaskFunc*                            rtcpRRHandler,
+                           void*                                rtcpRRHandlerClientData,
+                           unsigned short&                      rtpSeqNum,
+                           unsigned&                            rtpTimestamp,
+                           ServerRequestAlternativeByteHandler* serverRequestAlternativeByteHandler,
+                           void*                                serverRequestAlternativeByteHandlerClientData);
+  virtual void deleteStream(unsigned clientSessionId, void*& streamToken);
   virtual FramedSource* createNewStreamSource(unsigned clientSessionId, unsigned& estBitrate);
   virtual RTPSink*      createNewRTPSink(Groupsock*    rtpGroupsock,
                                          unsigned char rtpPayloadTypeIfDynamic,
                                          FramedSource* inputSource);
+
+private:
+  unsigned   m_framerate;
+  bool       m_lowLatency;
+  unsigned   m_keepAliveMs;
+  JPEGRelay* m_relay;
+
+  // shared parsed frame of fFileName, unused for live (low-latency) inputs
+  std::shared_ptr<JPEGFrameStore> m_store;
+
+  unsigned m_sdpGeneration    = ~0u;
+  int      m_sdpAddressFamily = -1;
+
+  struct Interleaving
+  {
+    int           socketNum;
+    unsigned char channelId;
+  };
+  std::map<unsigned, Interleaving> m_interleaved; // by client session
+
+#ifdef JPEG_TRACE
+  struct RRHook
+  {
+    TaskFunc* handler;
+    void*     clientData;
+    unsigned  clientSessionId;
+  };
+  static void onRTCPRR(void* clientData);
+
+  std::map<unsigned, RRHook> m_rrHooks;
+#endif
 };
@@ -0,0 +1,93 @@
+#include "OverloadControl.hh"
+
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <cstdio>
+
+bool sendQueueCongested(int socketNum)
+{
+  int pending = 0;
+  int sndbuf  = 0;
+
+  socklen_t len = sizeof sndbuf;
+  if (socketNum < 0 || ioctl(socketNum, SIOCOUTQ, &pending) != 0 ||
+      getsockopt(socketNum, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) != 0 || sndbuf <= 0)
+    return false;
+
+  return (long)pending * 100 > (long)sndbuf * SEND_QUEUE_HIGH_WATERMARK_PERCENT;
+}
+
+unsigned sendQueueSpace(int socketNum)
+{
+  int pending = 0;
+  int sndbuf  = 0;
+
+  socklen_t len = sizeof sndbuf;
+  if (socketNum < 0 || ioctl(socketNum, SIOCOUTQ, &pending) != 0 ||
+      getsockopt(socketNum, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) != 0 || sndbuf <= 0)
+    return 0;
+
+  /* Linux reports twice the size asked for, the other half being its own bookkeeping */
+  return sndbuf / 2 > pending ? sndbuf / 2 - pending : 0;
+}
+
+static long elapsedUs(const struct timeval& from, const struct timeval& to)
+{
+  return (to.tv_sec - from.tv_sec) * 1000000L + (to.tv_usec - from.tv_usec);
+}
+
+OverloadGovernor& OverloadGovernor::instance()
+{
+  static OverloadGovernor governor;
+  return governor;
+}
+
+void OverloadGovernor::start(UsageEnvironment& env, unsigned budgetPercent)
+{
+  if (budgetPercent == 0)
+    return;
+
+  m_env           = &env;
+  m_budgetPercent = budgetPercent;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  timeradd(&usage.ru_utime, &usage.ru_stime, &m_lastCpu);
+  gettimeofday(&m_lastWall, nullptr);
+
+  env.taskScheduler().scheduleDelayedTask(GOVERNOR_PERIOD_US, sample, this);
+}
+
+void OverloadGovernor::sample(void* clientData)
+{
+  ((OverloadGovernor*)clientData)->sample();
+}
+
+void OverloadGovernor::sample()
+{
+  struct rusage  usage;
+  struct timeval cpu, wall;
+
+  getrusage(RUSAGE_SELF, &usage);
+  timeradd(&usage.ru_utime, &usage.ru_stime, &cpu);
+  gettimeofday(&wall, nullptr);
+
+  long     wallUs  = elapsedUs(m_lastWall, wall);
+  unsigned percent = wallUs > 0 ? (unsigned)(elapsedUs(m_lastCpu, cpu) * 100 / wallUs) : 0;
+  m_lastCpu        = cpu;
+  m_lastWall       = wall;
+
+  /* step one divisor at a time, back off only well below the budget to avoid flapping */
+  unsigned previous = m_divisor;
+  if (percent > m_budgetPercent && m_divisor < GOVERNOR_MAX_DIVISOR)
+    m_divisor++;
+  else if (percent * 10 < m_budgetPercent * 7 && m_divisor > 1)
+    m_divisor--;
+
+  if (m_divisor != previous)
+    fprintf(stderr, "governor: cpu %u%% of %u%% budget, frame rate divided by %u\n", percent, m_budgetPercent, m_divisor);
+
+  m_env->taskScheduler().scheduleDelayedTask(GOVERNOR_PERIOD_US, sample, this);
+}
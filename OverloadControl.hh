@@ -0,0 +1,62 @@
+#pragma once
+
+#include <UsageEnvironment.hh>
+
+#include <sys/resource.h>
+#include <sys/time.h>
+
+// Skip frames for a client while its kernel send queue is above this share of SO_SNDBUF.
+#define SEND_QUEUE_HIGH_WATERMARK_PERCENT 50
+
+// How often the governor samples process CPU time.
+#define GOVERNOR_PERIOD_US 1000000
+
+// Largest frame-interval multiplier the governor will apply.
+#define GOVERNOR_MAX_DIVISOR 8
+
+// Returns true if the socket's unsent bytes exceed SEND_QUEUE_HIGH_WATERMARK_PERCENT of its send buffer.
+bool sendQueueCongested(int socketNum);
+
+// Returns a conservative estimate of the bytes the socket takes right now without blocking.
+unsigned sendQueueSpace(int socketNum);
+
+/*
+ * OverloadGovernor:
+ *
+ * Keeps the process within a CPU budget by stretching every source's frame
+ * interval by the same factor, so all clients degrade together instead of
+ * the event loop falling behind for everyone. Samples getrusage() once per
+ * GOVERNOR_PERIOD_US from a task on the scheduler.
+ */
+class OverloadGovernor
+{
+public:
+  static OverloadGovernor& instance();
+
+  // budgetPercent of one core; 0 disables the governor.
+  void start(UsageEnvironment& env, unsigned budgetPercent);
+
+  // Frame interval to use in place of baseIntervalUs.
+  unsigned frameInterval(unsigned baseIntervalUs) const
+  {
+    return baseIntervalUs * m_divisor;
+  }
+
+  unsigned divisor() const
+  {
+    return m_divisor;
+  }
+
+private:
+  OverloadGovernor() = default;
+
+  static void sample(void* clientData);
+  void        sample();
+
+private:
+  UsageEnvironment* m_env           = nullptr;
+  unsigned          m_budgetPercent = 0;
+  unsigned          m_divisor       = 1;
+  struct timeval    m_lastWall      = {0, 0};
+  struct timeval    m_lastCpu       = {0, 0};
+};
@@ -0,0 +1,201 @@
+#include "SharedFrameRing.hh"
+#include "FrameTrace.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+
+// Times a reader retries a slot the writer keeps rewriting (or died in) before giving up until the next poll.
+#define SHARED_RING_READ_ATTEMPTS 4
+
+#define ROUND_UP_CACHE_LINE(num) (((num) + 63) & ~(size_t)63)
+
+std::unique_ptr<SharedFrameRing> SharedFrameRing::createNew(UsageEnvironment& env, const char* name)
+{
+  size_t slotStride = ROUND_UP_CACHE_LINE(sizeof(Slot) + SHARED_RING_SLOT_SZ);
+  size_t size       = ROUND_UP_CACHE_LINE(sizeof(Header)) + SHARED_RING_SLOTS * slotStride;
+
+  int fd = memfd_create(name, MFD_CLOEXEC);
+  if (fd < 0)
+  {
+    env.setResultErrMsg("could not create shared frame ring: ");
+    return nullptr;
+  }
+
+  /* a fresh memfd reads as zeros: no frame written, every slot's sequence even */
+  void* base = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+  {
+    env.setResultErrMsg("could not map shared frame ring: ");
+    ::close(fd);
+    return nullptr;
+  }
+
+  return std::unique_ptr<SharedFrameRing>(new SharedFrameRing(fd, base, size));
+}
+
+SharedFrameRing::SharedFrameRing(int fd, void* base, size_t size)
+    : m_fd(fd), m_base(base), m_size(size), m_slotStride(ROUND_UP_CACHE_LINE(sizeof(Slot) + SHARED_RING_SLOT_SZ))
+{}
+
+SharedFrameRing::~SharedFrameRing()
+{
+  munmap(m_base, m_size);
+  ::close(m_fd);
+}
+
+SharedFrameRing::Slot* SharedFrameRing::slot(uint64_t frameNumber) const
+{
+  uint8_t* slots = (uint8_t*)m_base + ROUND_UP_CACHE_LINE(sizeof(Header));
+  return (Slot*)(slots + (frameNumber % SHARED_RING_SLOTS) * m_slotStride);
+}
+
+bool SharedFrameRing::write(const JPEGFrame& frame)
+{
+  if (frame.length > SHARED_RING_SLOT_SZ || frame.quantisation.size() > sizeof(Slot::quantisation))
+    return false;
+
+  auto*    header      = (Header*)m_base;
+  uint64_t frameNumber = header->written.load(std::memory_order_relaxed) + 1;
+  Slot*    s           = slot(frameNumber);
+
+  uint64_t sequence = s->sequence.load(std::memory_order_relaxed);
+  s->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  s->frameNumber      = frameNumber;
+  s->length           = frame.length;
+  s->scanOffset       = frame.payload.payload - frame.buffer.data();
+  s->payload          = frame.payload;
+  s->precision        = frame.precision;
+  s->quantisationSize = frame.quantisation.size();
+  memcpy(s->quantisation, frame.quantisation.data(), frame.quantisation.size());
+  s->fingerprint   = frame.fingerprint;
+  s->captureTimeUs = frame.captureTimeUs;
+  s->traceId       = frame.traceId;
+  memcpy((uint8_t*)(s + 1), frame.buffer.data(), frame.length);
+
+  s->sequence.store(sequence + 2, std::memory_order_release);
+  header->written.store(frameNumber, std::memory_order_release);
+  return true;
+}
+
+std::shared_ptr<JPEGFrame> SharedFrameRing::read(uint64_t& frameNumber) const
+{
+  auto* header = (Header*)m_base;
+
+  for (int attempt = 0; attempt < SHARED_RING_READ_ATTEMPTS; attempt++)
+  {
+    uint64_t newest = header->written.load(std::memory_order_acquire);
+    if (newest == 0 || newest == frameNumber)
+      return nullptr;
+
+    Slot*    s        = slot(newest);
+    uint64_t sequence = s->sequence.load(std::memory_order_acquire);
+    if (sequence & 1)
+      continue;
+
+    /* copy the descriptor, and only trust its sizes once the slot is known not to have changed under us */
+    auto     frame      = std::make_shared<JPEGFrame>();
+    uint64_t slotFrame  = s->frameNumber;
+    uint32_t scanOffset = s->scanOffset;
+    uint32_t qtSize     = s->quantisationSize;
+
+    frame->length        = s->length;
+    frame->payload       = s->payload;
+    frame->precision     = s->precision;
+    frame->fingerprint   = s->fingerprint;
+    frame->captureTimeUs = s->captureTimeUs;
+    frame->traceId       = s->traceId;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s->sequence.load(std::memory_order_relaxed) != sequence || slotFrame != newest)
+      continue;
+    if (frame->length > SHARED_RING_SLOT_SZ || qtSize > sizeof(Slot::quantisation) ||
+        scanOffset + frame->payload.size > frame->length)
+      return nullptr;
+
+    frame->buffer = FrameBufferPool::instance().acquire(frame->length);
+    if (!frame->buffer)
+      return nullptr;
+    memcpy(frame->buffer.data(), (uint8_t*)(s + 1), frame->length);
+    frame->quantisation.assign(s->quantisation, s->quantisation + qtSize);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s->sequence.load(std::memory_order_relaxed) != sequence)
+      continue;
+
+    frame->payload.payload = frame->buffer.data() + scanOffset;
+    frameNumber            = newest;
+    return frame;
+  }
+
+  return nullptr;
+}
+
+std::unique_ptr<SharedFrameFeed> SharedFrameFeed::createWriter(UsageEnvironment&               env,
+                                                               SharedFrameRing&                ring,
+                                                               std::shared_ptr<JPEGFrameStore> store)
+{
+  return std::unique_ptr<SharedFrameFeed>(new SharedFrameFeed(env, ring, std::move(store), true));
+}
+
+std::unique_ptr<SharedFrameFeed> SharedFrameFeed::createReader(UsageEnvironment&               env,
+                                                               SharedFrameRing&                ring,
+                                                               std::shared_ptr<JPEGFrameStore> store)
+{
+  return std::unique_ptr<SharedFrameFeed>(new SharedFrameFeed(env, ring, std::move(store), false));
+}
+
+SharedFrameFeed::SharedFrameFeed(UsageEnvironment&               env,
+                                 SharedFrameRing&                ring,
+                                 std::shared_ptr<JPEGFrameStore> store,
+                                 bool                            writer)
+    : m_env(env), m_ring(ring), m_store(std::move(store)), m_writer(writer)
+{
+  poll();
+}
+
+SharedFrameFeed::~SharedFrameFeed()
+{
+  m_env.taskScheduler().unscheduleDelayedTask(m_pollTask);
+}
+
+void SharedFrameFeed::poll(void* clientData)
+{
+  ((SharedFrameFeed*)clientData)->poll();
+}
+
+void SharedFrameFeed::poll()
+{
+  m_pollTask = m_env.taskScheduler().scheduleDelayedTask(SHARED_RING_POLL_US, poll, this);
+
+  if (!m_writer)
+  {
+    std::shared_ptr<JPEGFrame> frame = m_ring.read(m_frameNumber);
+    if (frame)
+    {
+      TRACE_INSTANT("ring_read", frame->traceId);
+      m_store->publish(std::move(frame));
+    }
+    return;
+  }
+
+  m_store->refresh();
+  std::shared_ptr<const JPEGFrame> frame = m_store->current();
+  if (!frame || m_store->generation() == m_generation)
+    return;
+  m_generation = m_store->generation();
+
+  if (!m_ring.write(*frame))
+  {
+    if (!m_tooLarge)
+      m_env << "SharedFrameRing: dropping frames of \"" << m_store->fileName().c_str() << "\" larger than a ring slot\n";
+    m_tooLarge = true;
+    return;
+  }
+  TRACE_INSTANT("ring_write", frame->traceId);
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "JPEGFrameStore.hh"
+
+#include <UsageEnvironment.hh>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Frames kept per ring. A reader only ever wants the newest, the others give
+// a slow reader time to finish copying before its slot is reused.
+#define SHARED_RING_SLOTS 4
+
+// Largest frame a ring slot holds, headers included.
+#define SHARED_RING_SLOT_SZ (2 * 1024 * 1024)
+
+// How often a SharedFrameFeed looks for a new frame.
+#define SHARED_RING_POLL_US 5000
+
+/*
+ * SharedFrameRing:
+ *
+ * Hands parsed frames from one ingest process to any number of server
+ * processes. The ring lives in a memfd mapping created before the workers are
+ * forked, so every process sees the same pages.
+ *
+ * Each slot holds a frame's bytes together with its parse results (the
+ * RTP/JPEG header fields and quantisation tables), so a frame is read and
+ * parsed once per host. Slots are guarded by a seqlock: the writer never
+ * waits for readers, and a reader that finds its slot rewritten while it was
+ * copying simply tries again with the newer frame.
+ */
+class SharedFrameRing
+{
+public:
+  static std::unique_ptr<SharedFrameRing> createNew(UsageEnvironment& env, const char* name);
+  ~SharedFrameRing();
+
+  SharedFrameRing(const SharedFrameRing&)            = delete;
+  SharedFrameRing& operator=(const SharedFrameRing&) = delete;
+
+  // Ingest process. Returns false if the frame is larger than a slot.
+  bool write(const JPEGFrame& frame);
+
+  // Server processes. The newest frame as a copy in a pooled buffer, or nullptr
+  // if there is none newer than frameNumber, which is then updated.
+  std::shared_ptr<JPEGFrame> read(uint64_t& frameNumber) const;
+
+private:
+  struct Slot
+  {
+    std::atomic<uint64_t>      sequence; // odd while the writer is in the slot
+    uint64_t                   frameNumber;
+    uint32_t                   length;
+    uint32_t                   scanOffset;
+    JpegParser::RtpJPEGPayload payload; // payload pointer is only valid in the writer
+    uint32_t                   precision;
+    uint32_t                   quantisationSize;
+    uint8_t                    quantisation[256];
+    uint64_t                   fingerprint;
+    uint64_t                   captureTimeUs;
+    uint32_t                   traceId;
+    // frame bytes follow
+  };
+
+  struct Header
+  {
+    std::atomic<uint64_t> written; // number of the last frame written, 0 for none
+  };
+
+  static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock free");
+
+  SharedFrameRing(int fd, void* base, size_t size);
+
+  Slot* slot(uint64_t frameNumber) const;
+
+private:
+  int    m_fd;
+  void*  m_base;
+  size_t m_size;
+  size_t m_slotStride;
+};
+
+/*
+ * SharedFrameFeed:
+ *
+ * Moves frames between a JPEGFrameStore and a SharedFrameRing, polling every
+ * SHARED_RING_POLL_US: a writer copies each new frame of the ingest process's
+ * store into the ring, a reader publishes each new frame of the ring into a
+ * worker's store, from where it is served like any other.
+ */
+class SharedFrameFeed
+{
+public:
+  static std::unique_ptr<SharedFrameFeed> createWriter(UsageEnvironment&               env,
+                                                       SharedFrameRing&                ring,
+                                                       std::shared_ptr<JPEGFrameStore> store);
+  static std::unique_ptr<SharedFrameFeed> createReader(UsageEnvironment&               env,
+                                                       SharedFrameRing&                ring,
+                                                       std::shared_ptr<JPEGFrameStore> store);
+  ~SharedFrameFeed();
+
+  SharedFrameFeed(const SharedFrameFeed&)            = delete;
+  SharedFrameFeed& operator=(const SharedFrameFeed&) = delete;
+
+private:
+  SharedFrameFeed(UsageEnvironment& env, SharedFrameRing& ring, std::shared_ptr<JPEGFrameStore> store, bool writer);
+
+  static void poll(void* clientData);
+  void        poll();
+
+private:
+  UsageEnvironment&               m_env;
+  SharedFrameRing&                m_ring;
+  std::shared_ptr<JPEGFrameStore> m_store;
+  bool                            m_writer;
+  TaskToken                       m_pollTask = nullptr;
+
+  unsigned m_generation  = 0; // writer: store generation last written
+  uint64_t m_frameNumber = 0; // reader: ring frame last published
+  bool     m_tooLarge    = false;
+};
@@ -0,0 +1,495 @@
+// Measures RTSP session setup against a running server, as in a reconnect
+// storm after a network blip: the latency of DESCRIBE, SETUP, PLAY and of the
+// first frame after PLAY, and how many complete sessions per second the server
+// sustains with a number of clients connecting at once.
+//
+//   RTSPSetupBench [-n sessions] [-c concurrent] [-t] rtsp://host:7070/JPEG
+//
+// With -l it also measures glass-to-glass latency against a server started
+// with a low-latency input: the bench stands in for the camera, writing an
+// image into that FIFO at a steady rate and noting when each frame's first
+// byte went in, and a single session plays the stream for a while. Each
+// frame's RTP timestamp is mapped to the server's wall clock through RTCP
+// sender reports, which gives the time the server started reading it and so
+// the frame it was captured as; its latency runs from that capture to the
+// arrival of its marker packet. Run it on the server's host.
+//
+//   RTSPSetupBench -l /tmp/camera.fifo [-j image.jpg] [-f fps] [-d seconds] rtsp://localhost:7070/JPEG
+
+#include "BasicUsageEnvironment.hh"
+#include "liveMedia.hh"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A session that has not received its first frame by then counts as failed.
+#define BENCH_SESSION_TIMEOUT_US 5000000
+
+// Receive buffer of each client; larger frames arrive truncated, which is all the same here.
+#define BENCH_FRAME_BUFFER_SZ (512 * 1024)
+
+// Capture times kept for matching received frames against; a few seconds' worth at any sane rate.
+#define BENCH_CAPTURES_KEPT 1024
+
+// How far a frame's RTCP-mapped time may lie before its capture time: RTP timestamp rounding and clock reads.
+#define BENCH_CAPTURE_SLACK_US 1000
+
+namespace
+{
+
+  enum Step
+  {
+    STEP_DESCRIBE,
+    STEP_SETUP,
+    STEP_PLAY,
+    STEP_FIRST_FRAME,
+    STEP_GLASS_TO_GLASS, // per frame, with -l only
+    STEP_COUNT
+  };
+
+  const char* const k_stepNames[STEP_COUNT] = {"DESCRIBE", "SETUP", "PLAY", "first frame", "glass-to-glass"};
+
+  UsageEnvironment* env;
+  char const*       url;
+  unsigned          sessions   = 200;
+  unsigned          concurrent = 10;
+  bool              overTCP    = false;
+
+  // glass-to-glass mode
+  char const*          latencyInput   = nullptr;
+  char const*          latencyImage   = "test.jpg";
+  unsigned             latencyFps     = 25;
+  unsigned             latencySeconds = 10;
+  std::vector<uint8_t> image;
+  std::mutex           capturesMutex;
+  std::deque<uint64_t> capturesUs; // wall clock of each frame written, oldest first
+  std::atomic<bool>    captureStop{false};
+
+  unsigned              started   = 0;
+  unsigned              completed = 0;
+  unsigned              failed    = 0;
+  std::vector<uint64_t> latencyUs[STEP_COUNT];
+  char volatile         done = 0;
+
+  uint64_t nowUs()
+  {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  }
+
+  void startClient(); // forward
+
+  // The camera: writes image into latencyInput latencyFps times a second, on a thread
+  // of its own so that the event loop's timing of arriving frames is not held up.
+  void captureFrames()
+  {
+    uint64_t interval = 1000000 / latencyFps;
+    uint64_t next     = nowUs();
+    int      fd       = -1;
+
+    while (!captureStop)
+    {
+      /* the server opens its input when the first client sets up the stream */
+      if (fd < 0 && (fd = open(latencyInput, O_WRONLY | O_NONBLOCK)) >= 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+      if (fd >= 0)
+      {
+        {
+          std::lock_guard<std::mutex> lock(capturesMutex);
+          capturesUs.push_back(nowUs());
+          if (capturesUs.size() > BENCH_CAPTURES_KEPT)
+            capturesUs.pop_front();
+        }
+
+        for (size_t done = 0; done < image.size();)
+        {
+          ssize_t n = write(fd, image.data() + done, image.size() - done);
+          if (n <= 0)
+          {
+            close(fd);
+            fd = -1;
+            break;
+          }
+          done += n;
+        }
+      }
+
+      next += interval;
+      uint64_t now = nowUs();
+      if (next > now)
+        usleep(next - now);
+      else
+        next = now;
+    }
+
+    if (fd >= 0)
+      close(fd);
+  }
+
+  // The capture time of the frame the server started reading at presentedUs, 0 if none matches.
+  uint64_t captureTimeOf(uint64_t presentedUs)
+  {
+    std::lock_guard<std::mutex> lock(capturesMutex);
+
+    auto it = std::upper_bound(capturesUs.begin(), capturesUs.end(), presentedUs + BENCH_CAPTURE_SLACK_US);
+    if (it == capturesUs.begin())
+      return 0;
+    uint64_t captureUs = *--it;
+
+    /* a frame read long after the last write is not one of ours */
+    return presentedUs < captureUs + 1000000 / latencyFps ? captureUs : 0;
+  }
+
+  class BenchClient;
+
+  // Takes frames from the subsession until the first one arrives.
+  class FirstFrameSink : public MediaSink
+  {
+  public:
+    FirstFrameSink(UsageEnvironment& env, BenchClient& client) : MediaSink(env), m_client(client) {}
+
+  private:
+    virtual Boolean continuePlaying() override;
+
+    static void afterGettingFrame(void*          clientData,
+                                  unsigned       frameSize,
+                                  unsigned       numTruncatedBytes,
+                                  struct timeval presentationTime,
+                                  unsigned       durationInMicroseconds);
+
+  private:
+    BenchClient&         m_client;
+    std::vector<uint8_t> m_buffer = std::vector<uint8_t>(BENCH_FRAME_BUFFER_SZ);
+  };
+
+  // One session: DESCRIBE, SETUP of the first subsession, PLAY, first frame, TEARDOWN.
+  class BenchClient : public RTSPClient
+  {
+  public:
+    static BenchClient* createNew(UsageEnvironment& env, char const* rtspURL)
+    {
+      return new BenchClient(env, rtspURL);
+    }
+
+    void start()
+    {
+      m_timeoutTask = envir().taskScheduler().scheduleDelayedTask(BENCH_SESSION_TIMEOUT_US, onTimeout, this);
+      m_stepStart   = nowUs();
+      sendDescribeCommand(onDescribe);
+    }
+
+    // Returns true while the client wants further frames.
+    bool frameArrived(struct timeval presentationTime)
+    {
+      uint64_t receivedUs = nowUs();
+
+      if (!m_playing)
+      {
+        finishStep(STEP_FIRST_FRAME);
+        m_playing = true;
+
+        /* not from within the RTP source's delivery, closing the session deletes the source */
+        int64_t playUs = latencyInput != nullptr ? latencySeconds * 1000000LL : 0;
+        envir().taskScheduler().rescheduleDelayedTask(m_timeoutTask, playUs, onDone, this);
+      }
+
+      /* until the first sender report, presentation times are the client's guess */
+      if (latencyInput == nullptr || !m_subsession->rtpSource()->hasBeenSynchronizedUsingRTCP())
+        return latencyInput != nullptr;
+
+      uint64_t presentedUs = (uint64_t)presentationTime.tv_sec * 1000000 + presentationTime.tv_usec;
+      if (uint64_t captureUs = captureTimeOf(presentedUs))
+        latencyUs[STEP_GLASS_TO_GLASS].push_back(receivedUs - captureUs);
+      return true;
+    }
+
+  private:
+    BenchClient(UsageEnvironment& env, char const* rtspURL) : RTSPClient(env, rtspURL, 0, "RTSPSetupBench", 0, -1) {}
+
+    virtual ~BenchClient()
+    {
+      envir().taskScheduler().unscheduleDelayedTask(m_timeoutTask);
+      if (m_subsession != nullptr)
+      {
+        Medium::close(m_subsession->sink);
+        m_subsession->sink = nullptr;
+      }
+      Medium::close(m_session);
+    }
+
+    void finishStep(Step step)
+    {
+      uint64_t now = nowUs();
+      latencyUs[step].push_back(now - m_stepStart);
+      m_stepStart = now;
+    }
+
+    // Tears the session down and deletes the client, which must not be used afterwards.
+    void finish(bool ok)
+    {
+      if (m_session != nullptr)
+        sendTeardownCommand(*m_session, nullptr);
+
+      ok ? completed++ : failed++;
+      Medium::close(this);
+      startClient();
+    }
+
+    static void onDescribe(RTSPClient* rtspClient, int resultCode, char* resultString)
+    {
+      auto* client = (BenchClient*)rtspClient;
+      if (resultCode != 0)
+      {
+        delete[] resultString;
+        client->finish(false);
+        return;
+      }
+      client->finishStep(STEP_DESCRIBE);
+
+      client->m_session = MediaSession::createNew(client->envir(), resultString);
+      delete[] resultString;
+      if (client->m_session == nullptr)
+      {
+        client->finish(false);
+        return;
+      }
+
+      MediaSubsessionIterator iter(*client->m_session);
+      client->m_subsession = iter.next();
+      if (client->m_subsession == nullptr || !client->m_subsession->initiate())
+      {
+        client->m_subsession = nullptr;
+        client->finish(false);
+        return;
+      }
+
+      client->sendSetupCommand(*client->m_subsession, onSetup, False, overTCP);
+    }
+
+    static void onSetup(RTSPClient* rtspClient, int resultCode, char* resultString)
+    {
+      auto* client = (BenchClient*)rtspClient;
+      delete[] resultString;
+      if (resultCode != 0)
+      {
+        client->finish(false);
+        return;
+      }
+      client->finishStep(STEP_SETUP);
+
+      MediaSubsession* subsession = client->m_subsession;
+      subsession->sink            = new FirstFrameSink(client->envir(), *client);
+      subsession->sink->startPlaying(*subsession->readSource(), nullptr, nullptr);
+
+      client->sendPlayCommand(*client->m_session, onPlay);
+    }
+
+    static void onPlay(RTSPClient* rtspClient, int resultCode, char* resultString)
+    {
+      auto* client = (BenchClient*)rtspClient;
+      delete[] resultString;
+      if (resultCode != 0)
+      {
+        client->finish(false);
+        return;
+      }
+      client->finishStep(STEP_PLAY);
+    }
+
+    static void onDone(void* clientData)
+    {
+      auto* client          = (BenchClient*)clientData;
+      client->m_timeoutTask = nullptr;
+      client->finish(true);
+    }
+
+    static void onTimeout(void* clientData)
+    {
+      auto* client          = (BenchClient*)clientData;
+      client->m_timeoutTask = nullptr;
+      client->finish(false);
+    }
+
+  private:
+    MediaSession*    m_session     = nullptr;
+    MediaSubsession* m_subsession  = nullptr;
+    uint64_t         m_stepStart   = 0;
+    TaskToken        m_timeoutTask = nullptr;
+    bool             m_playing     = false;
+  };
+
+  Boolean FirstFrameSink::continuePlaying()
+  {
+    if (fSource == nullptr)
+      return False;
+
+    fSource->getNextFrame(m_buffer.data(), m_buffer.size(), afterGettingFrame, this, onSourceClosure, this);
+    return True;
+  }
+
+  void FirstFrameSink::afterGettingFrame(void* clientData,
+                                         unsigned /*frameSize*/,
+                                         unsigned /*numTruncatedBytes*/,
+                                         struct timeval presentationTime,
+                                         unsigned /*durationInMicroseconds*/)
+  {
+    auto* sink = (FirstFrameSink*)clientData;
+    if (sink->m_client.frameArrived(presentationTime))
+      sink->continuePlaying();
+  }
+
+  void startClient()
+  {
+    if (started == sessions)
+    {
+      if (completed + failed == sessions)
+        done = 1;
+      return;
+    }
+
+    started++;
+    BenchClient::createNew(*env, url)->start();
+  }
+
+  void report(uint64_t elapsedUs)
+  {
+    for (unsigned step = 0; step < STEP_COUNT; step++)
+    {
+      std::vector<uint64_t>& samples = latencyUs[step];
+      if (samples.empty())
+        continue;
+      std::sort(samples.begin(), samples.end());
+
+      printf("%-12s n=%-6zu min %7.2f ms  median %7.2f ms  p99 %7.2f ms  max %7.2f ms\n",
+             k_stepNames[step],
+             samples.size(),
+             samples.front() / 1000.0,
+             samples[samples.size() / 2] / 1000.0,
+             samples[samples.size() * 99 / 100] / 1000.0,
+             samples.back() / 1000.0);
+    }
+
+    printf("%u sessions ok, %u failed in %.2f s: %.1f sessions/s with %u concurrent\n",
+           completed,
+           failed,
+           elapsedUs / 1e6,
+           completed * 1e6 / elapsedUs,
+           concurrent);
+  }
+
+  void usage(const char* progName)
+  {
+    fprintf(stderr,
+            "Usage: %s [-n sessions] [-c concurrent] [-t] [-l fifo [-j image] [-f fps] [-d seconds]] <rtsp-url>\n",
+            progName);
+    fprintf(stderr, "  -n: sessions to set up in total (default: 200)\n");
+    fprintf(stderr, "  -c: sessions being set up at once (default: 10)\n");
+    fprintf(stderr, "  -t: stream RTP over the RTSP connection\n");
+    fprintf(stderr, "  -l: measure glass-to-glass latency with one session, feeding the server's low-latency input\n");
+    fprintf(stderr, "  -j, -f, -d: image written to it (default: test.jpg), at this rate (default: 25),\n"
+                    "              for this long after the first frame (default: 10)\n");
+    exit(1);
+  }
+
+  bool loadImage(const char* path)
+  {
+    FILE* fp = fopen(path, "rb");
+    if (fp == nullptr)
+      return false;
+
+    uint8_t buf[65536];
+    size_t  n;
+    while ((n = fread(buf, 1, sizeof buf, fp)) > 0)
+      image.insert(image.end(), buf, buf + n);
+    fclose(fp);
+    return !image.empty();
+  }
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "n:c:tl:j:f:d:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      if (sscanf(optarg, "%u", &sessions) != 1 || sessions == 0)
+        usage(argv[0]);
+      break;
+    case 'c':
+      if (sscanf(optarg, "%u", &concurrent) != 1 || concurrent == 0)
+        usage(argv[0]);
+      break;
+    case 't':
+      overTCP = true;
+      break;
+    case 'l':
+      latencyInput = optarg;
+      break;
+    case 'j':
+      latencyImage = optarg;
+      break;
+    case 'f':
+      if (sscanf(optarg, "%u", &latencyFps) != 1 || latencyFps == 0)
+        usage(argv[0]);
+      break;
+    case 'd':
+      if (sscanf(optarg, "%u", &latencySeconds) != 1 || latencySeconds == 0)
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc)
+    usage(argv[0]);
+  url = argv[optind];
+
+  std::thread camera;
+  if (latencyInput != nullptr)
+  {
+    if (!loadImage(latencyImage))
+    {
+      fprintf(stderr, "Unable to read %s\n", latencyImage);
+      return 1;
+    }
+
+    /* one session, long enough for sender reports to come in */
+    sessions   = 1;
+    concurrent = 1;
+    signal(SIGPIPE, SIG_IGN);
+    camera = std::thread(captureFrames);
+  }
+
+  TaskScheduler* scheduler = BasicTaskScheduler::createNew();
+  env                      = BasicUsageEnvironment::createNew(*scheduler);
+
+  uint64_t start = nowUs();
+  for (unsigned i = 0; i < concurrent; i++)
+    startClient();
+
+  env->taskScheduler().doEventLoop(&done);
+
+  if (camera.joinable())
+  {
+    captureStop = true;
+    camera.join();
+  }
+  report(nowUs() - start);
+
+  return failed == 0 ? 0 : 1;
+}
@@ -4,23 +4,80 @@
 #include "GroupsockHelper.hh"
 #include "liveMedia.hh"
 #include <iostream>
+#include <signal.h>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
 
 #include "BasicUsageEnvironment.hh"
+#include "FrameBufferPool.h"
+#include "FrameTrace.h"
 #include "JPEGFramedSource.hh"
+#include "JPEGHTTPServer.hh"
+#include "JPEGRTSPServer.hh"
+#include "JPEGRelay.hh"
+#include "JPEGTestPattern.hh"
 #include "JPEGUnicastSubsession.h"
+#include "OverloadControl.hh"
+#include "SharedFrameRing.hh"
 
 UsageEnvironment* env;
 char*             progName;
 int               fps;
+char const*       lowLatencyInput = NULL;
+unsigned          keepAliveMs     = 0;
+unsigned          maxSessions     = 0;
+unsigned          maxPerStream    = 0;
+unsigned          cpuBudget       = 0;
+unsigned          httpPort        = 0;
+unsigned          workers         = 0;
+TestPatternParams patternParams;
+bool              testPattern = false;
 
-void play(); // forward
+std::vector<char const*> relayUrls;
+
+void play();        // forward
+void playWorkers(); // forward
 
 void usage()
 {
-  std::cerr << "Usage: " << progName << " <frames-per-second>\n";
+  std::cerr << "Usage: " << progName
+            << " [-k keep-alive-ms] [-s max-sessions] [-p max-sessions-per-stream] [-c cpu-budget-percent]"
+               " [-t WxH[,quality[,frame-bytes]]] [-r rtsp-url]... [-H http-port] [-w workers]"
+               " <frames-per-second> [low-latency-input]\n";
+  std::cerr << "  -k: send unchanged frames only every keep-alive-ms (default: send every frame)\n";
+  std::cerr << "  -s, -p: answer SETUP with 453 beyond this many sessions (default: unlimited);\n"
+               "          with -w, each worker admits its share, rounded up\n";
+  std::cerr << "  -c: lower the frame rate for all clients to stay within this share of a core\n";
+  std::cerr << "  -r: also relay this upstream RTP/JPEG stream, served as \"relay1\", \"relay2\", ...\n";
+  std::cerr << "  -t: also serve a synthetic test pattern as stream \"pattern\"\n";
+  std::cerr << "  -H: also serve every stream as MJPEG (/<stream>/mjpeg) and snapshots (/<stream>/snapshot.jpg)\n";
+  std::cerr << "  -w: read and parse frames in this process and serve them from this many worker processes;\n"
+               "      a session must stay on the connection that set it up, and RTSP-over-HTTP is refused\n";
+  std::cerr << "  any stream can be served cropped as rtsp://host:7070/<stream>?roi=x,y,w,h (or /<stream>/mjpeg?roi=...)\n";
+  std::cerr << "  low-latency-input: FIFO or file of back-to-back JPEGs, sent as they arrive\n";
   exit(1);
 }
 
+// Set on SIGINT/SIGTERM to leave the event loop, so that shutdown reporting runs.
+static volatile char stopRequested = 0;
+
+static void onStopSignal(int /*signum*/)
+{
+  stopRequested = 1;
+}
+
+// Without SA_RESTART, so that the signal also wakes the scheduler's select().
+static void installStopHandler()
+{
+  struct sigaction sa = {};
+  sa.sa_handler       = onStopSignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
+
 static void announceStream(RTSPServer*         rtspServer,
                            ServerMediaSession* sms,
                            char const*         streamName,
@@ -42,15 +99,74 @@ static void announceStream(RTSPServer*         rtspServer,
 int main(int argc, char** argv)
 {
   progName = argv[0];
-  if (argc != 2)
+
+  int opt;
+  while ((opt = getopt(argc, argv, "k:s:p:c:t:r:H:w:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'k':
+      if (sscanf(optarg, "%u", &keepAliveMs) != 1)
+        usage();
+      break;
+    case 's':
+      if (sscanf(optarg, "%u", &maxSessions) != 1)
+        usage();
+      break;
+    case 'p':
+      if (sscanf(optarg, "%u", &maxPerStream) != 1)
+        usage();
+      break;
+    case 'c':
+      if (sscanf(optarg, "%u", &cpuBudget) != 1)
+        usage();
+      break;
+    case 't':
+      if (sscanf(optarg,
+                 "%ux%u,%u,%u",
+                 &patternParams.width,
+                 &patternParams.height,
+                 &patternParams.quality,
+                 &patternParams.frameBytes) < 2)
+        usage();
+      testPattern = true;
+      break;
+    case 'r':
+      relayUrls.push_back(optarg);
+      break;
+    case 'H':
+      if (sscanf(optarg, "%u", &httpPort) != 1 || httpPort == 0 || httpPort > 65535)
+        usage();
+      break;
+    case 'w':
+      if (sscanf(optarg, "%u", &workers) != 1 || workers == 0)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if (argc != 1 && argc != 2)
     usage();
 
-  if (sscanf(argv[1], "%d", &fps) != 1 || fps <= 0)
+  if (sscanf(argv[0], "%d", &fps) != 1 || fps <= 0)
   {
     usage();
   }
+  if (argc == 2)
+    lowLatencyInput = argv[1];
+
+  /* a live input is read as it is sent, there are no frames to share between processes */
+  if (workers > 0 && lowLatencyInput != NULL)
+    usage();
 
-  play();
+  if (workers > 0)
+    playWorkers();
+  else
+    play();
 
   return 0;
 }
@@ -75,15 +191,8 @@ void play()
   TaskScheduler* scheduler = BasicTaskScheduler::createNew();
   env                      = BasicUsageEnvironment::createNew(*scheduler);
 
-  sessionState.source = JPEGFramedSource::createNew(*env, fps);
-  if (sessionState.source == NULL)
-  {
-    *env << "Unable to open webcam: " << env->getResultMsg() << "\n";
-    exit(1);
-  }
-
   // Create and start a RTSP server to serve this stream:
-  sessionState.rtspServer = RTSPServer::createNew(*env, 7070);
+  sessionState.rtspServer = JPEGRTSPServer::createNew(*env, 7070, maxSessions, maxPerStream);
   if (sessionState.rtspServer == NULL)
   {
     *env << "Failed to create RTSP server: " << env->getResultMsg() << "\n";
@@ -91,12 +200,289 @@ void play()
   }
 
   ServerMediaSession* sms = ServerMediaSession::createNew(*env, "JPEG", progName, "JPEG Stream", False);
-  sms->addSubsession(JPEGServerMediaSubsession::createNew(*env, "test.jpg"));
+  JPEGServerMediaSubsession* subsession;
+  if (lowLatencyInput != NULL)
+    subsession = JPEGServerMediaSubsession::createNew(*env, lowLatencyInput, fps, true);
+  else
+    subsession = JPEGServerMediaSubsession::createNew(*env, "test.jpg", fps, false, keepAliveMs);
+  if (subsession == NULL)
+  {
+    *env << "Unable to open input: " << env->getResultMsg() << "\n";
+    exit(1);
+  }
+  sms->addSubsession(subsession);
   sessionState.rtspServer->addServerMediaSession(sms);
 
   announceStream(sessionState.rtspServer, sms, "StreamName", "InputFileName");
 
-  env->taskScheduler().doEventLoop();
+  static std::unique_ptr<JPEGTestPattern> pattern;
+  if (testPattern)
+  {
+    pattern = JPEGTestPattern::createNew(*env, JPEGFrameStore::create("pattern"), patternParams, fps);
+    if (!pattern)
+    {
+      *env << "Unable to create test pattern: " << env->getResultMsg() << "\n";
+      exit(1);
+    }
+
+    ServerMediaSession* patternSms =
+        ServerMediaSession::createNew(*env, "pattern", progName, "Synthetic test pattern", False);
+    patternSms->addSubsession(JPEGServerMediaSubsession::createNew(*env, "pattern", fps, false, keepAliveMs));
+    sessionState.rtspServer->addServerMediaSession(patternSms);
+
+    announceStream(sessionState.rtspServer, patternSms, "pattern", "pattern");
+  }
+
+  static std::vector<std::unique_ptr<JPEGRelay>> relays;
+  for (char const* url : relayUrls)
+  {
+    std::string name  = "relay" + std::to_string(relays.size() + 1);
+    auto        relay = JPEGRelay::createNew(*env, url, JPEGFrameStore::create(name));
+    if (!relay)
+    {
+      *env << "Unable to relay " << url << ": " << env->getResultMsg() << "\n";
+      exit(1);
+    }
+
+    ServerMediaSession* relaySms = ServerMediaSession::createNew(*env, name.c_str(), url, "Relayed JPEG stream", False);
+    relaySms->addSubsession(
+        JPEGServerMediaSubsession::createNew(*env, name.c_str(), fps, false, keepAliveMs, relay.get()));
+    sessionState.rtspServer->addServerMediaSession(relaySms);
+    relays.push_back(std::move(relay));
+
+    announceStream(sessionState.rtspServer, relaySms, name.c_str(), url);
+  }
+
+  static std::unique_ptr<JPEGHTTPServer> httpServer;
+  if (httpPort != 0)
+  {
+    httpServer = JPEGHTTPServer::createNew(*env, httpPort, fps);
+    if (!httpServer)
+    {
+      *env << "Failed to create HTTP server: " << env->getResultMsg() << "\n";
+      exit(1);
+    }
+
+    /* live (low-latency) inputs have no frame store and are RTSP only */
+    if (lowLatencyInput == NULL)
+      httpServer->addStream("JPEG", JPEGFrameStore::lookup("test.jpg"));
+    if (testPattern)
+      httpServer->addStream("pattern", JPEGFrameStore::create("pattern"));
+    for (size_t i = 0; i < relays.size(); i++)
+    {
+      std::string name = "relay" + std::to_string(i + 1);
+      httpServer->addStream(name, JPEGFrameStore::create(name));
+    }
+    *env << "MJPEG and snapshots on http://<host>:" << httpPort << "/<stream>/mjpeg\n";
+  }
+
+  OverloadGovernor::instance().start(*env, cpuBudget);
+  TRACE_INSTALL_SIGNAL(*env);
+  installStopHandler();
+
+  env->taskScheduler().doEventLoop(&stopRequested);
+  FrameBufferPool::instance().printStats(stderr);
+}
+
+// How often the ingest process checks for worker processes that died.
+#define WORKER_CHECK_US 1000000
+
+// A stream of the multi-process server: read and parsed by the ingest process,
+// served by every worker from the ring.
+struct SharedStream
+{
+  std::string                      name;
+  std::unique_ptr<SharedFrameRing> ring;
+};
+
+static std::vector<SharedStream> sharedStreams;
+static std::vector<pid_t>        workerPids;
+
+// A worker's share of a session limit of the whole server; 0 stays unlimited. Rounded
+// up, so the server as a whole may admit up to workers - 1 sessions more than asked.
+static unsigned workerLimit(unsigned limit)
+{
+  return limit == 0 ? 0 : (limit + workers - 1) / workers;
+}
+
+// Runs in a forked worker process and never returns. Only the shared rings' mappings
+// are used from the parent; everything else is set up afresh.
+static void serveWorker(unsigned index, pid_t parent)
+{
+  /* workers go with the ingest process, whichever way it ends; it may have ended before prctl() */
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != parent)
+    _exit(0);
+
+  /* a restarted worker is forked from the running ingest process: drop its sockets,
+   * files and pipes (the rings stay mapped), its stores and its trace state */
+  TRACE_AFTER_FORK();
+  close_range(3, ~0U, 0);
+  JPEGFrameStore::forgetAll();
+
+  TaskScheduler* scheduler = BasicTaskScheduler::createNew();
+  env                      = BasicUsageEnvironment::createNew(*scheduler);
+
+  /* SO_REUSEPORT spreads connections over the workers, each admits its share of the limits */
+  RTSPServer* rtspServer =
+      JPEGRTSPServer::createNew(*env, 7070, workerLimit(maxSessions), workerLimit(maxPerStream), true);
+  if (rtspServer == NULL)
+  {
+    *env << "Worker " << index << " failed to create RTSP server: " << env->getResultMsg() << "\n";
+    _exit(1);
+  }
+
+  std::unique_ptr<JPEGHTTPServer> httpServer;
+  if (httpPort != 0)
+  {
+    httpServer = JPEGHTTPServer::createNew(*env, httpPort, fps, true);
+    if (!httpServer)
+    {
+      *env << "Worker " << index << " failed to create HTTP server: " << env->getResultMsg() << "\n";
+      _exit(1);
+    }
+  }
+
+  std::vector<std::unique_ptr<SharedFrameFeed>> feeds;
+  for (SharedStream& shared : sharedStreams)
+  {
+    auto store = JPEGFrameStore::create(shared.name);
+    feeds.push_back(SharedFrameFeed::createReader(*env, *shared.ring, store));
+
+    ServerMediaSession* sms = ServerMediaSession::createNew(*env, shared.name.c_str(), progName, "JPEG Stream", False);
+    sms->addSubsession(JPEGServerMediaSubsession::createNew(*env, shared.name.c_str(), fps, false, keepAliveMs));
+    rtspServer->addServerMediaSession(sms);
+
+    if (httpServer)
+      httpServer->addStream(shared.name, store);
+  }
+
+  OverloadGovernor::instance().start(*env, cpuBudget);
+  TRACE_INSTALL_SIGNAL(*env);
+  installStopHandler();
+
+  env->taskScheduler().doEventLoop(&stopRequested);
+  *env << "Worker " << index << ": ";
+  FrameBufferPool::instance().printStats(stderr);
+  _exit(0);
+}
+
+static void spawnWorker(unsigned index)
+{
+  pid_t parent = getpid();
+  pid_t pid    = fork();
+  if (pid == 0)
+    serveWorker(index, parent);
+  if (pid < 0)
+    *env << "Unable to start worker " << index << "\n";
+  workerPids[index] = pid;
+}
+
+// A worker that crashed only took its own clients with it; start a new one in its place.
+static void checkWorkers(void* /*clientData*/)
+{
+  int   status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+  {
+    for (unsigned i = 0; i < workerPids.size(); i++)
+    {
+      if (workerPids[i] != pid)
+        continue;
+      *env << "Worker " << i << " exited, restarting it\n";
+      spawnWorker(i);
+    }
+  }
+
+  for (unsigned i = 0; i < workerPids.size(); i++)
+  {
+    if (workerPids[i] < 0)
+      spawnWorker(i);
+  }
+
+  env->taskScheduler().scheduleDelayedTask(WORKER_CHECK_US, checkWorkers, NULL);
+}
+
+// Multi-process mode: this process reads, parses and relays every stream once
+// and hands the frames to the workers through shared memory; the workers share
+// the RTSP (and HTTP) port through SO_REUSEPORT and serve the clients.
+void playWorkers()
+{
+  TaskScheduler* scheduler = BasicTaskScheduler::createNew();
+  env                      = BasicUsageEnvironment::createNew(*scheduler);
+
+  std::vector<std::string> names = {"JPEG"};
+  if (testPattern)
+    names.push_back("pattern");
+  for (size_t i = 0; i < relayUrls.size(); i++)
+    names.push_back("relay" + std::to_string(i + 1));
+
+  /* the rings have to exist before the first fork for the workers to share them */
+  for (const std::string& name : names)
+  {
+    auto ring = SharedFrameRing::createNew(*env, name.c_str());
+    if (!ring)
+    {
+      *env << "Unable to share stream " << name.c_str() << ": " << env->getResultMsg() << "\n";
+      exit(1);
+    }
+    sharedStreams.push_back({name, std::move(ring)});
+  }
+
+  workerPids.assign(workers, -1);
+  for (unsigned i = 0; i < workers; i++)
+    spawnWorker(i);
+
+  static std::vector<std::unique_ptr<SharedFrameFeed>> feeds;
+
+  auto jpeg = JPEGFrameStore::lookup("test.jpg");
+  if (!jpeg)
+  {
+    *env << "Unable to open input: test.jpg\n";
+    exit(1);
+  }
+  feeds.push_back(SharedFrameFeed::createWriter(*env, *sharedStreams[0].ring, jpeg));
+
+  size_t next = 1;
+
+  static std::unique_ptr<JPEGTestPattern> pattern;
+  if (testPattern)
+  {
+    pattern = JPEGTestPattern::createNew(*env, JPEGFrameStore::create("pattern"), patternParams, fps);
+    if (!pattern)
+    {
+      *env << "Unable to create test pattern: " << env->getResultMsg() << "\n";
+      exit(1);
+    }
+    feeds.push_back(SharedFrameFeed::createWriter(*env, *sharedStreams[next++].ring, JPEGFrameStore::create("pattern")));
+  }
+
+  /* workers serve relayed streams from their reassembled frames, pass-through needs the upstream packets */
+  static std::vector<std::unique_ptr<JPEGRelay>> relays;
+  for (char const* url : relayUrls)
+  {
+    const std::string& name  = sharedStreams[next].name;
+    auto               relay = JPEGRelay::createNew(*env, url, JPEGFrameStore::create(name));
+    if (!relay)
+    {
+      *env << "Unable to relay " << url << ": " << env->getResultMsg() << "\n";
+      exit(1);
+    }
+    feeds.push_back(SharedFrameFeed::createWriter(*env, *sharedStreams[next++].ring, JPEGFrameStore::create(name)));
+    relays.push_back(std::move(relay));
+  }
+
+  *env << "Serving ";
+  for (const std::string& name : names)
+    *env << "rtsp://<host>:7070/" << name.c_str() << " ";
+  *env << "from " << workers << " worker processes\n";
+
+  checkWorkers(NULL);
+  TRACE_INSTALL_SIGNAL(*env);
+  installStopHandler();
+
+  env->taskScheduler().doEventLoop(&stopRequested);
+  FrameBufferPool::instance().printStats(stderr);
 }
 
 void afterPlaying(void* /*clientData*/)
@@ -111,6 +497,8 @@ void afterPlaying(void* /*clientData*/)
   Medium::close(sessionState.rtcpInstance);
   delete sessionState.rtcpGroupsock;
 
+  FrameBufferPool::instance().printStats(stderr);
+
   // We're done:
   exit(0);
 }